@@ -0,0 +1,357 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Microbenchmarks for the host side encode/decode paths. Results are
+ * written to stdout as JSON, one entry per function and payload size.
+ * Each entry is the best of BENCH_RUNS runs, to keep numbers stable
+ * between invocations.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cbor.h>
+
+#include "serial_upload.h"
+#include "crc/crc16.h"
+#include "base64/base64.h"
+
+#define BENCH_RUNS              5
+#define BENCH_MIN_NS            20000000ULL     /* per run */
+#define BENCH_BUF_SZ            4096
+
+SESSION_LOCAL struct upload_state state;
+const char *cmdname = "bench";
+
+static const size_t bench_sizes[] = { 32, 64, 128, 256, 512, 1024, 2048 };
+#define BENCH_SIZE_CNT  (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+static uint8_t bench_data[BENCH_BUF_SZ];
+static uint8_t bench_pkt[BENCH_BUF_SZ];
+static size_t bench_pkt_len;
+static char bench_b64[BENCH_BUF_SZ * 2];
+static uint8_t bench_out[BENCH_BUF_SZ * 2];
+static struct segx_tmpl bench_tmpl;
+static volatile unsigned int bench_sink;
+
+/*
+ * Framed NLIP data. Writes go to this buffer when capturing, and reads
+ * replay it over and over.
+ */
+static char bench_nlip[BENCH_BUF_SZ * 2];
+static size_t bench_nlip_len;
+static size_t bench_nlip_off;
+static int bench_nlip_capture;
+
+struct bench {
+    const char *b_name;
+    void (*b_setup)(size_t sz);
+    void (*b_run)(size_t sz);
+    int b_sized;                        /* 0 if payload size is fixed */
+    size_t b_maxsz;                     /* 0 if no limit */
+};
+
+void
+dump_hex(const char *hdr, void *bufv, int cnt)
+{
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bench_nlip_write(void *buf, size_t len)
+{
+    if (bench_nlip_capture) {
+        if (bench_nlip_len + len > sizeof(bench_nlip)) {
+            return -1;
+        }
+        memcpy(&bench_nlip[bench_nlip_len], buf, len);
+        bench_nlip_len += len;
+    }
+    bench_sink += len;
+    return 0;
+}
+
+static int
+bench_nlip_read(char *buf, size_t maxlen, uint32_t end_ms)
+{
+    size_t cnt;
+
+    if (bench_nlip_off == bench_nlip_len) {
+        bench_nlip_off = 0;
+    }
+    cnt = bench_nlip_len - bench_nlip_off;
+    if (cnt > maxlen) {
+        cnt = maxlen;
+    }
+    memcpy(buf, &bench_nlip[bench_nlip_off], cnt);
+    bench_nlip_off += cnt;
+    return cnt;
+}
+
+static const struct nlip_io bench_nlip_io = {
+    .ni_write = bench_nlip_write,
+    .ni_read = bench_nlip_read,
+};
+
+static void
+bench_setup_none(size_t sz)
+{
+}
+
+static void
+bench_run_crc16(size_t sz)
+{
+    bench_sink += crc16_ccitt(0, bench_data, sz);
+}
+
+static void
+bench_run_b64_enc(size_t sz)
+{
+    bench_sink += base64_encode(bench_data, sz, bench_b64, 1);
+}
+
+static void
+bench_setup_b64_dec(size_t sz)
+{
+    base64_encode(bench_data, sz, bench_b64, 1);
+}
+
+static void
+bench_run_b64_dec(size_t sz)
+{
+    bench_sink += base64_decode(bench_b64, bench_out);
+}
+
+static void
+bench_run_segX(size_t sz)
+{
+    bench_sink += serial_uploader_create_segX(bench_out, sizeof(bench_out),
+      sz, bench_data, sz);
+}
+
+static void
+bench_setup_tmpl(size_t sz)
+{
+    serial_uploader_segX_tmpl_init(&bench_tmpl);
+}
+
+static void
+bench_run_tmpl(size_t sz)
+{
+    struct pkt_iov iov[SEGX_IOV_CNT];
+
+    bench_sink += serial_uploader_segX_tmpl_fill(&bench_tmpl, sz,
+      bench_data, sz, iov);
+}
+
+/*
+ * Upload response, the way device would send it.
+ */
+static void
+bench_setup_rsp(size_t sz)
+{
+    CborEncoder enc;
+    CborEncoder map;
+    size_t len;
+
+    memset(bench_pkt, 0, 8);
+    bench_pkt[0] = 3;                           /* write rsp */
+    bench_pkt[5] = 1;                           /* image group */
+    bench_pkt[7] = 1;                           /* upload */
+    cbor_encoder_init(&enc, &bench_pkt[8], sizeof(bench_pkt) - 8, 0);
+    cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&map, "rc");
+    cbor_encode_int(&map, 0);
+    cbor_encode_text_stringz(&map, "off");
+    cbor_encode_uint(&map, 123456);
+    cbor_encoder_close_container(&enc, &map);
+    len = cbor_encoder_get_buffer_size(&enc, &bench_pkt[8]);
+    bench_pkt[2] = len >> 8;
+    bench_pkt[3] = len;
+    bench_pkt_len = len + 8;
+}
+
+static void
+bench_run_rsp(size_t sz)
+{
+    size_t off;
+
+    bench_sink += serial_uploader_decode_rsp(bench_pkt, bench_pkt_len, &off);
+    bench_sink += off;
+}
+
+static void
+bench_setup_nlip_tx(size_t sz)
+{
+    bench_pkt_len = serial_uploader_create_segX(bench_pkt, sizeof(bench_pkt),
+      sz, bench_data, sz);
+}
+
+static void
+bench_run_nlip_tx(size_t sz)
+{
+    struct pkt_iov iov;
+
+    iov.pi_base = bench_pkt;
+    iov.pi_len = bench_pkt_len;
+    nlip_xport_tx(&iov, 1);
+}
+
+/*
+ * Response packet of sz bytes, framed once and then parsed from the
+ * captured stream.
+ */
+static void
+bench_setup_nlip_rx(size_t sz)
+{
+    struct pkt_iov iov;
+
+    memcpy(bench_pkt, bench_data, sz);
+    bench_pkt[0] = 1;                           /* read rsp */
+    iov.pi_base = bench_pkt;
+    iov.pi_len = sz;
+
+    bench_nlip_len = 0;
+    bench_nlip_off = 0;
+    bench_nlip_capture = 1;
+    nlip_xport_tx(&iov, 1);
+    bench_nlip_capture = 0;
+}
+
+static void
+bench_run_nlip_rx(size_t sz)
+{
+    uint8_t *pkt;
+
+    bench_sink += nlip_xport_rx(&pkt, 0);
+}
+
+static const struct bench benches[] = {
+    { "crc16_ccitt", bench_setup_none, bench_run_crc16, 1 },
+    { "base64_encode", bench_setup_none, bench_run_b64_enc, 1 },
+    { "base64_decode", bench_setup_b64_dec, bench_run_b64_dec, 1 },
+    { "create_segX", bench_setup_none, bench_run_segX, 1 },
+    { "segX_tmpl_fill", bench_setup_tmpl, bench_run_tmpl, 1 },
+    { "decode_rsp", bench_setup_rsp, bench_run_rsp, 0 },
+    { "nlip_tx", bench_setup_nlip_tx, bench_run_nlip_tx, 1 },
+    /* has to fit in reassembly buffer with length and CRC */
+    { "nlip_rx", bench_setup_nlip_rx, bench_run_nlip_rx, 1, 1024 },
+};
+#define BENCH_CNT       (sizeof(benches) / sizeof(benches[0]))
+
+static uint64_t
+bench_time(const struct bench *b, size_t sz, uint64_t iters)
+{
+    uint64_t start;
+    uint64_t i;
+
+    start = bench_now_ns();
+    for (i = 0; i < iters; i++) {
+        b->b_run(sz);
+    }
+    return bench_now_ns() - start;
+}
+
+/*
+ * Finds iteration count which takes at least BENCH_MIN_NS, and returns
+ * the best time per iteration over BENCH_RUNS runs.
+ */
+static double
+bench_one(const struct bench *b, size_t sz, uint64_t *itersp)
+{
+    uint64_t iters;
+    uint64_t ns;
+    uint64_t best;
+    int i;
+
+    b->b_setup(sz);
+    for (iters = 1; ; iters *= 2) {
+        ns = bench_time(b, sz, iters);
+        if (ns >= BENCH_MIN_NS) {
+            break;
+        }
+    }
+    best = ns;
+    for (i = 1; i < BENCH_RUNS; i++) {
+        ns = bench_time(b, sz, iters);
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    *itersp = iters;
+    return (double)best / iters;
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct bench *b;
+    uint64_t iters;
+    double ns;
+    size_t sz;
+    int first = 1;
+    int i;
+    int j;
+
+    srand(1);
+    for (i = 0; i < BENCH_BUF_SZ; i++) {
+        bench_data[i] = rand();
+    }
+    state.linelen = SHELL_NLIP_MAX_FRAME;
+    state.line_raw = NLIP_LINE_RAW(state.linelen);
+    nlip_attach(&bench_nlip_io);
+
+    printf("{\n  \"linelen\": %d,\n  \"results\": [", state.linelen);
+    for (i = 0; i < BENCH_CNT; i++) {
+        b = &benches[i];
+        for (j = 0; j < BENCH_SIZE_CNT; j++) {
+            sz = bench_sizes[j];
+            if (b->b_maxsz && sz > b->b_maxsz) {
+                break;
+            }
+            ns = bench_one(b, sz, &iters);
+            if (!b->b_sized) {
+                sz = bench_pkt_len;
+            }
+            printf("%s\n    { \"name\": \"%s\", \"size\": %zu, "
+              "\"iters\": %" PRIu64 ", \"ns_per_op\": %.1f, "
+              "\"ns_per_byte\": %.3f, \"frames_per_sec\": %.0f }",
+              first ? "" : ",", b->b_name, sz, iters, ns, ns / sz,
+              1e9 / ns);
+            first = 0;
+            if (!b->b_sized) {
+                break;
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return bench_sink == 0xdeadbeef;
+}
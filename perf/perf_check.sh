@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+#
+# Uploads reference images to perf/simdev over a pty, TCP or UDP, and
+# compares goodput and retransmit counts against perf/baseline.txt.
+# The fsdownload case reads the image back as a file instead.
+#
+# Usage: perf_check.sh [-u]
+#   -u   write results as the new baseline
+#
+# PERF_TOL is the allowed goodput drop in percent (default 10).
+# PERF_PORT is the localhost port for TCP and UDP cases (default 17337).
+#
+
+PERF_DIR=$(dirname "$0")
+UPLOADER=${UPLOADER:-./serial_upload}
+SIMDEV=${SIMDEV:-./perf/simdev}
+BASELINE=$PERF_DIR/baseline.txt
+PERF_TOL=${PERF_TOL:-10}
+PERF_PORT=${PERF_PORT:-17337}
+WORK=$(mktemp -d /tmp/perf_check.XXXXXX)
+RESULTS=$WORK/results.txt
+
+trap 'rm -rf "$WORK"' EXIT
+
+# run_case <name> <image size> <simdev options> <uploader options>
+#   [tcp|udp|fsdownload]
+run_case() {
+    img=$WORK/$1.img
+    dev=$WORK/$1.pty
+    ready=$dev
+    op="-f $img"
+
+    $SIMDEV -g "$2" "$img" || exit 1
+    case "$5" in
+    tcp|udp)
+        ready=$WORK/$1.ready
+        [ "$5" = tcp ] && sim_opt=-t || sim_opt=-u
+        $SIMDEV $sim_opt $PERF_PORT -r "$ready" -f "$img" $3 &
+        dev=$5:127.0.0.1:$PERF_PORT
+        ;;
+    fsdownload)
+        printf "fsdownload /%s %s\nreset\n" "$1.img" "$WORK/$1.dl" \
+          > "$WORK/$1.m"
+        op="-m $WORK/$1.m"
+        $SIMDEV -p "$dev" -f "$img" $3 &
+        ;;
+    *)
+        $SIMDEV -p "$dev" -f "$img" $3 &
+        ;;
+    esac
+    sim=$!
+    i=0
+    while [ ! -e "$ready" ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    $UPLOADER -d "$dev" $op $4 > "$WORK/$1.out" 2>&1
+    rc=$?
+    wait $sim
+    sim_rc=$?
+    if [ $rc -ne 0 ] || [ $sim_rc -ne 0 ]; then
+        echo "perf-check: $1 upload failed"
+        cat "$WORK/$1.out"
+        exit 1
+    fi
+    if [ "$5" = fsdownload ] && ! cmp -s "$img" "$WORK/$1.dl"; then
+        echo "perf-check: $1 downloaded file does not match"
+        exit 1
+    fi
+
+    # "<n> bytes in <t>s (<goodput> B/s), ... <r> retransmits"
+    sed -n 's/.*(\([0-9]*\) B\/s).* \([0-9]*\) retransmits.*/\1 \2/p' \
+      "$WORK/$1.out" | head -1 | (read goodput retx;
+      printf "%-12s %10s %6s\n" "$1" "$goodput" "$retx") >> "$RESULTS"
+}
+
+printf "# %-10s %10s %6s\n" "case" "B/s" "retx" > "$RESULTS"
+run_case small-chunk 65536 "-b 921600 -l 2" "-s 921600 -c 128"
+run_case default 65536 "-b 921600 -l 2" "-s 921600"
+run_case long-lines 131072 "-b 921600 -l 2" "-s 921600 -c 2048 -l 1024"
+run_case lossy 65536 "-b 921600 -l 2 -d 16" "-s 921600"
+run_case uring 65536 "-b 921600 -l 2" "-s 921600 -I uring"
+run_case tcp 65536 "-b 921600 -l 2" "" tcp
+run_case udp 65536 "-b 921600 -l 2" "-c 1024" udp
+run_case fsdownload 65536 "-b 921600 -l 2" "" fsdownload
+
+if [ "$1" = "-u" ]; then
+    cp "$RESULTS" "$BASELINE"
+    cat "$BASELINE"
+    exit 0
+fi
+
+awk -v tol="$PERF_TOL" '
+    BEGIN {
+        printf "%-12s %10s %10s %6s %6s %6s\n", "case", "B/s", "baseline",
+          "", "retx", "base"
+    }
+    /^#/ { next }
+    NR == FNR { base_gp[$1] = $2; base_retx[$1] = $3; next }
+    {
+        if (!($1 in base_gp)) {
+            printf "%-12s %10d %10s %6d %6s   new\n", $1, $2, "-", $3, "-"
+            next
+        }
+        min_gp = base_gp[$1] * (100 - tol) / 100
+        max_retx = base_retx[$1] + 1 + int(base_retx[$1] / 10)
+        result = "ok"
+        if ($2 < min_gp || $3 > max_retx) {
+            result = "REGRESSION"
+            fail = 1
+        }
+        printf "%-12s %10d %10d %+5.1f%% %6d %6d   %s\n", $1, $2,
+          base_gp[$1], ($2 - base_gp[$1]) * 100 / base_gp[$1], $3,
+          base_retx[$1], result
+    }
+    END { exit fail }
+' "$BASELINE" "$RESULTS"
+rc=$?
+if [ $rc -ne 0 ]; then
+    echo "perf-check: performance regression, tolerance $PERF_TOL%"
+fi
+exit $rc
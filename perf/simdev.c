@@ -0,0 +1,769 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Stand-in for a device running newtmgr over serial, for measuring
+ * upload performance. Serves a pty, a TCP port like a serial device
+ * server would, or a UDP port with newtmgr packets as is. Data going both
+ * ways is paced to match the given baud rate. Every response is delayed by
+ * a fixed latency, which stands for USB-serial latency and flash write
+ * time. Uploaded image is checked against the one given with -f.
+ * File reads with the FS group return that same file, whatever the name.
+ *
+ * Can also generate the reference images used in tests.
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <sys/types.h>
+#include <sys/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cbor.h>
+
+#include "crc/crc16.h"
+#include "base64/base64.h"
+#include "sha256/sha256.h"
+
+#define SIM_LINE_MAX            1100
+#define SIM_PKT_MAX             4096
+#define SIM_RSP_LINE_RAW        93      /* 128 byte lines */
+#define SIM_TMO                 120     /* seconds */
+#define SIM_LINGER_MS           500
+#define SIM_DL_CHUNK            512     /* file read response data */
+
+struct sim_hdr {
+    uint8_t sh_op;
+    uint8_t sh_flags;
+    uint16_t sh_len;
+    uint16_t sh_group;
+    uint8_t sh_seq;
+    uint8_t sh_id;
+};
+
+enum sim_mode {
+    SIM_PTY,
+    SIM_TCP,
+    SIM_UDP                                     /* no NLIP framing */
+};
+
+static const char *simname;
+static enum sim_mode sim_mode;
+static int sim_fd;
+static int sim_baud = 921600;
+static int sim_latency_ms;
+static int sim_drop_every;
+static int sim_ack_cnt;
+static uint64_t sim_link_us;             /* link busy until */
+
+static uint8_t *sim_ref;
+static size_t sim_ref_sz;
+static uint8_t *sim_img;
+static size_t sim_img_sz;
+static size_t sim_img_off;
+static int sim_dl_cnt;                  /* file reads served */
+
+static uint64_t
+sim_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sim_sleep_until(uint64_t us)
+{
+    uint64_t now;
+
+    now = sim_now_us();
+    if (us > now) {
+        usleep(us - now);
+    }
+}
+
+/*
+ * Time it takes to move cnt bytes over the emulated link, 10 bits
+ * per byte.
+ */
+static void
+sim_link_pace(size_t cnt)
+{
+    uint64_t now;
+
+    now = sim_now_us();
+    if (sim_link_us < now) {
+        sim_link_us = now;
+    }
+    sim_link_us += (uint64_t)cnt * 10 * 1000000 / sim_baud;
+    sim_sleep_until(sim_link_us);
+}
+
+static int
+sim_write(const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t rc;
+
+    sim_link_pace(len);
+    while (len) {
+        rc = write(sim_fd, p, len);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+static void
+sim_rsp_send(struct sim_hdr *req, uint8_t *body, size_t blen)
+{
+    uint8_t pkt[SIM_PKT_MAX];
+    char line[SIM_LINE_MAX];
+    struct sim_hdr *hdr;
+    uint16_t crc;
+    size_t len;
+    size_t off;
+    size_t cnt;
+    int llen;
+
+    usleep(sim_latency_ms * 1000);
+
+    hdr = (struct sim_hdr *)&pkt[2];
+    *hdr = *req;
+    hdr->sh_op = req->sh_op + 1;
+    hdr->sh_len = htons(blen);
+    memcpy(hdr + 1, body, blen);
+    len = sizeof(*hdr) + blen;
+    if (sim_mode == SIM_UDP) {
+        if (sim_write(hdr, len)) {
+            fprintf(stderr, "%s: write failed: %s\n", simname,
+              strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+    crc = htons(crc16_ccitt(CRC16_INITIAL_CRC, hdr, len));
+    memcpy(&pkt[2 + len], &crc, sizeof(crc));
+    len += sizeof(crc);
+    pkt[0] = len >> 8;
+    pkt[1] = len;
+    len += 2;
+
+    for (off = 0; off < len; off += cnt) {
+        line[0] = off ? 0x04 : 0x06;
+        line[1] = off ? 0x14 : 0x09;
+        cnt = len - off;
+        if (cnt > SIM_RSP_LINE_RAW) {
+            cnt = SIM_RSP_LINE_RAW;
+        }
+        llen = 2 + base64_encode(&pkt[off], cnt, &line[2], 1);
+        line[llen++] = '\n';
+        if (sim_write(line, llen)) {
+            fprintf(stderr, "%s: write failed: %s\n", simname,
+              strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+static void
+sim_rsp_rc(struct sim_hdr *req, int rc, int64_t off)
+{
+    uint8_t body[64];
+    CborEncoder enc;
+    CborEncoder map;
+
+    cbor_encoder_init(&enc, body, sizeof(body), 0);
+    cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&map, "rc");
+    cbor_encode_int(&map, rc);
+    if (off >= 0) {
+        cbor_encode_text_stringz(&map, "off");
+        cbor_encode_uint(&map, off);
+    }
+    cbor_encoder_close_container(&enc, &map);
+    sim_rsp_send(req, body, cbor_encoder_get_buffer_size(&enc, body));
+}
+
+static void
+sim_echo(struct sim_hdr *req, CborValue *map)
+{
+    uint8_t body[SIM_PKT_MAX];
+    char str[SIM_PKT_MAX];
+    CborEncoder enc;
+    CborEncoder rmap;
+    CborValue val;
+    size_t len = 0;
+
+    str[0] = '\0';
+    if (cbor_value_map_find_value(map, "d", &val) == CborNoError &&
+      cbor_value_is_text_string(&val)) {
+        len = sizeof(str);
+        cbor_value_copy_text_string(&val, str, &len, NULL);
+    }
+    cbor_encoder_init(&enc, body, sizeof(body), 0);
+    cbor_encoder_create_map(&enc, &rmap, CborIndefiniteLength);
+    cbor_encode_text_stringz(&rmap, "r");
+    cbor_encode_text_string(&rmap, str, len);
+    cbor_encoder_close_container(&enc, &rmap);
+    sim_rsp_send(req, body, cbor_encoder_get_buffer_size(&enc, body));
+}
+
+static void
+sim_upload(struct sim_hdr *req, CborValue *map)
+{
+    CborValue val;
+    uint64_t off;
+    uint64_t len;
+    size_t dlen;
+
+    if (cbor_value_map_find_value(map, "off", &val) ||
+      !cbor_value_is_unsigned_integer(&val) ||
+      cbor_value_get_uint64(&val, &off)) {
+        sim_rsp_rc(req, 3, -1);
+        return;
+    }
+    if (off == 0) {
+        if (cbor_value_map_find_value(map, "len", &val) ||
+          !cbor_value_is_unsigned_integer(&val) ||
+          cbor_value_get_uint64(&val, &len)) {
+            sim_rsp_rc(req, 3, -1);
+            return;
+        }
+        free(sim_img);
+        sim_img = malloc(len);
+        sim_img_sz = len;
+        sim_img_off = 0;
+    }
+    if (off != sim_img_off) {
+        sim_rsp_rc(req, 0, sim_img_off);
+        return;
+    }
+    if (cbor_value_map_find_value(map, "data", &val) ||
+      !cbor_value_is_byte_string(&val)) {
+        sim_rsp_rc(req, 3, -1);
+        return;
+    }
+    dlen = sim_img_sz - off;
+    if (cbor_value_copy_byte_string(&val, &sim_img[off], &dlen, NULL)) {
+        sim_rsp_rc(req, 3, -1);
+        return;
+    }
+    sim_img_off += dlen;
+    if (sim_drop_every && ++sim_ack_cnt % sim_drop_every == 0) {
+        return;
+    }
+    sim_rsp_rc(req, 0, sim_img_off);
+}
+
+static void
+sim_fs_read(struct sim_hdr *req, CborValue *map)
+{
+    uint8_t body[SIM_PKT_MAX];
+    CborEncoder enc;
+    CborEncoder rmap;
+    CborValue val;
+    uint64_t off;
+    size_t len;
+
+    if (!sim_ref) {
+        sim_rsp_rc(req, 5, -1);
+        return;
+    }
+    if (cbor_value_map_find_value(map, "off", &val) ||
+      !cbor_value_is_unsigned_integer(&val) ||
+      cbor_value_get_uint64(&val, &off) || off > sim_ref_sz) {
+        sim_rsp_rc(req, 3, -1);
+        return;
+    }
+    len = sim_ref_sz - off;
+    if (len > SIM_DL_CHUNK) {
+        len = SIM_DL_CHUNK;
+    }
+    cbor_encoder_init(&enc, body, sizeof(body), 0);
+    cbor_encoder_create_map(&enc, &rmap, CborIndefiniteLength);
+    cbor_encode_text_stringz(&rmap, "rc");
+    cbor_encode_int(&rmap, 0);
+    cbor_encode_text_stringz(&rmap, "off");
+    cbor_encode_uint(&rmap, off);
+    if (off == 0) {
+        cbor_encode_text_stringz(&rmap, "len");
+        cbor_encode_uint(&rmap, sim_ref_sz);
+    }
+    cbor_encode_text_stringz(&rmap, "data");
+    cbor_encode_byte_string(&rmap, &sim_ref[off], len);
+    cbor_encoder_close_container(&enc, &rmap);
+    sim_dl_cnt++;
+    sim_rsp_send(req, body, cbor_encoder_get_buffer_size(&enc, body));
+}
+
+/*
+ * Returns 1 when device gets reset.
+ */
+static int
+sim_pkt(uint8_t *pkt, size_t len)
+{
+    struct sim_hdr hdr;
+    CborParser parser;
+    CborValue map;
+    int rc = 0;
+
+    if (len < sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(&hdr, pkt, sizeof(hdr));
+    if (cbor_parser_init(pkt + sizeof(hdr), len - sizeof(hdr), 0, &parser,
+        &map) || !cbor_value_is_map(&map)) {
+        return 0;
+    }
+    switch (ntohs(hdr.sh_group) << 8 | hdr.sh_id) {
+    case 0x0000:                                /* echo */
+        sim_echo(&hdr, &map);
+        break;
+    case 0x0001:                                /* console echo ctrl */
+        sim_rsp_rc(&hdr, 0, -1);
+        break;
+    case 0x0005:                                /* reset */
+        sim_rsp_rc(&hdr, 0, -1);
+        rc = 1;
+        break;
+    case 0x0101:                                /* image upload */
+        sim_upload(&hdr, &map);
+        break;
+    case 0x0800:                                /* file */
+        if (hdr.sh_op == 0) {                   /* read */
+            sim_fs_read(&hdr, &map);
+        } else {
+            sim_rsp_rc(&hdr, 8, -1);
+        }
+        break;
+    default:
+        sim_rsp_rc(&hdr, 8, -1);
+        break;
+    }
+    return rc;
+}
+
+static int
+sim_run(void)
+{
+    char buf[512];
+    char line[SIM_LINE_MAX];
+    uint8_t pkt[SIM_PKT_MAX];
+    size_t llen = 0;
+    size_t plen = 0;
+    size_t want = 0;
+    uint64_t end;
+    ssize_t cnt;
+    ssize_t i;
+    int rc;
+    char c;
+
+    end = sim_now_us() + (uint64_t)SIM_TMO * 1000000;
+    while (sim_now_us() < end) {
+        cnt = read(sim_fd, buf, sizeof(buf));
+        if (cnt < 0) {
+            if (errno == EAGAIN || errno == EINTR || errno == EIO) {
+                usleep(1000);
+                continue;
+            }
+            fprintf(stderr, "%s: read failed: %s\n", simname,
+              strerror(errno));
+            return -1;
+        }
+        if (cnt == 0 && sim_mode == SIM_TCP) {
+            fprintf(stderr, "%s: connection closed\n", simname);
+            return -1;
+        }
+        sim_link_pace(cnt);
+        for (i = 0; i < cnt; i++) {
+            c = buf[i];
+            if (c != '\n') {
+                if (llen < sizeof(line) - 1) {
+                    line[llen++] = c;
+                }
+                continue;
+            }
+            line[llen] = '\0';
+            if (llen > 2 && line[0] == 0x06 && line[1] == 0x09) {
+                plen = 0;
+                want = SIM_PKT_MAX;
+            } else if (llen > 2 && line[0] == 0x04 && line[1] == 0x14 &&
+              want) {
+                ;
+            } else {
+                llen = 0;
+                continue;
+            }
+            llen = 0;
+            if (plen + base64_decode_len(&line[2]) + 3 > sizeof(pkt)) {
+                want = 0;
+                continue;
+            }
+            rc = base64_decode(&line[2], &pkt[plen]);
+            if (rc < 0) {
+                want = 0;
+                continue;
+            }
+            plen += rc;
+            if (want == SIM_PKT_MAX && plen >= 2) {
+                want = (pkt[0] << 8 | pkt[1]) + 2;
+            }
+            if (plen < want) {
+                continue;
+            }
+            want = 0;
+            if (crc16_ccitt(CRC16_INITIAL_CRC, &pkt[2], plen - 2) != 0) {
+                continue;
+            }
+            if (sim_pkt(&pkt[2], plen - 4)) {
+                /*
+                 * Give uploader time to read the response before pty
+                 * goes away.
+                 */
+                usleep(SIM_LINGER_MS * 1000);
+                return 0;
+            }
+        }
+    }
+    fprintf(stderr, "%s: timed out\n", simname);
+    return -1;
+}
+
+/*
+ * Datagram is a newtmgr packet, with no framing.
+ */
+static int
+sim_run_udp(void)
+{
+    uint8_t pkt[SIM_PKT_MAX];
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    uint64_t end;
+    ssize_t cnt;
+    int connected = 0;
+
+    end = sim_now_us() + (uint64_t)SIM_TMO * 1000000;
+    while (sim_now_us() < end) {
+        fromlen = sizeof(from);
+        cnt = recvfrom(sim_fd, pkt, sizeof(pkt), 0,
+          (struct sockaddr *)&from, &fromlen);
+        if (cnt < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                usleep(1000);
+                continue;
+            }
+            fprintf(stderr, "%s: read failed: %s\n", simname,
+              strerror(errno));
+            return -1;
+        }
+        if (!connected) {
+            /* responses go to whoever sent the first request */
+            if (connect(sim_fd, (struct sockaddr *)&from, fromlen)) {
+                fprintf(stderr, "%s: connect failed: %s\n", simname,
+                  strerror(errno));
+                return -1;
+            }
+            connected = 1;
+        }
+        sim_link_pace(cnt);
+        if (sim_pkt(pkt, cnt)) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "%s: timed out\n", simname);
+    return -1;
+}
+
+/*
+ * Listens on localhost. TCP takes one connection, and is then served like
+ * the pty.
+ */
+static int
+sim_listen(int port, const char *ready)
+{
+    struct sockaddr_in sin;
+    FILE *fp;
+    int val = 1;
+    int fd;
+
+    fd = socket(AF_INET, sim_mode == SIM_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: socket failed: %s\n", simname, strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+      (sim_mode == SIM_TCP && listen(fd, 1))) {
+        fprintf(stderr, "%s: port %d: %s\n", simname, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (ready) {
+        fp = fopen(ready, "w");
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    if (sim_mode == SIM_TCP) {
+        sim_fd = accept(fd, NULL, NULL);
+        close(fd);
+        if (sim_fd < 0) {
+            fprintf(stderr, "%s: accept failed: %s\n", simname,
+              strerror(errno));
+            return -1;
+        }
+    } else {
+        sim_fd = fd;
+    }
+    fcntl(sim_fd, F_SETFL, fcntl(sim_fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static int
+sim_open(const char *link)
+{
+    struct termios tios;
+    char *slave;
+    int sfd;
+
+    sim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_fd < 0 || grantpt(sim_fd) || unlockpt(sim_fd)) {
+        fprintf(stderr, "%s: pty open failed: %s\n", simname,
+          strerror(errno));
+        return -1;
+    }
+    slave = ptsname(sim_fd);
+
+    /*
+     * Keep the slave side open and in raw mode, so that nothing gets
+     * echoed back before uploader has set up the port.
+     */
+    sfd = open(slave, O_RDWR | O_NOCTTY);
+    if (sfd < 0 || tcgetattr(sfd, &tios)) {
+        fprintf(stderr, "%s: %s open failed: %s\n", simname, slave,
+          strerror(errno));
+        return -1;
+    }
+    cfmakeraw(&tios);
+    tcsetattr(sfd, TCSANOW, &tios);
+
+    unlink(link);
+    if (symlink(slave, link)) {
+        fprintf(stderr, "%s: symlink %s failed: %s\n", simname, link,
+          strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sim_file_read(const char *name)
+{
+    FILE *fp;
+    long sz;
+
+    fp = fopen(name, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", simname, name,
+          strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    sz = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    sim_ref = malloc(sz);
+    sim_ref_sz = fread(sim_ref, 1, sz, fp);
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Reference image; same on every run and host. MCUboot image of sz bytes
+ * in total, with pseudo-random body and SHA256 TLV.
+ */
+#define SIM_IMG_HDR_SZ          32
+#define SIM_IMG_TLV_SZ          (4 + 4 + 32)
+
+static void
+sim_put_le(uint8_t *p, uint32_t val, int len)
+{
+    while (len--) {
+        *p++ = val;
+        val >>= 8;
+    }
+}
+
+static int
+sim_gen(const char *name, size_t sz)
+{
+    struct sha256_ctx ctx;
+    uint8_t hdr[SIM_IMG_HDR_SZ];
+    uint8_t tlv[SIM_IMG_TLV_SZ];
+    uint8_t c;
+    FILE *fp;
+    uint32_t x = 0x12345678;
+    size_t i;
+
+    fp = fopen(name, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", simname, name,
+          strerror(errno));
+        return -1;
+    }
+    if (sz < SIM_IMG_HDR_SZ + SIM_IMG_TLV_SZ) {
+        fprintf(stderr, "%s: image size %zu too small\n", simname, sz);
+        fclose(fp);
+        return -1;
+    }
+    sz -= SIM_IMG_HDR_SZ + SIM_IMG_TLV_SZ;
+
+    memset(hdr, 0, sizeof(hdr));
+    sim_put_le(&hdr[0], 0x96f3b83d, 4);                 /* magic */
+    sim_put_le(&hdr[8], SIM_IMG_HDR_SZ, 2);             /* hdr size */
+    sim_put_le(&hdr[12], sz, 4);                        /* img size */
+    hdr[20] = 1;                                        /* version 1.0.0 */
+    sha256_init(&ctx);
+    sha256_update(&ctx, hdr, sizeof(hdr));
+    fwrite(hdr, 1, sizeof(hdr), fp);
+    for (i = 0; i < sz; i++) {
+        x = x * 1103515245 + 12345;
+        c = x >> 16;
+        sha256_update(&ctx, &c, 1);
+        fputc(c, fp);
+    }
+    sim_put_le(&tlv[0], 0x6907, 2);                     /* TLV info */
+    sim_put_le(&tlv[2], SIM_IMG_TLV_SZ, 2);
+    tlv[4] = 0x10;                                      /* SHA256 */
+    tlv[5] = 0;
+    sim_put_le(&tlv[6], 32, 2);
+    sha256_final(&ctx, &tlv[8]);
+    fwrite(tlv, 1, sizeof(tlv), fp);
+    fclose(fp);
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s -p <pty link> | -t <tcp port> | -u <udp port> "
+      "[-r <ready file>]\n"
+      "    [-f <file>] [-b <baud>] [-l <latency ms>] "
+      "[-d <drop every nth upload ack>]\n", simname);
+    fprintf(stderr, "%s -g <size> <file>\n", simname);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *link = NULL;
+    const char *file = NULL;
+    const char *ready = NULL;
+    int port = 0;
+    int opt;
+
+    simname = argv[0];
+    while ((opt = getopt(argc, argv, "p:t:u:r:f:b:l:d:g:")) != -1) {
+        switch (opt) {
+        case 'p':
+            link = optarg;
+            break;
+        case 't':
+            sim_mode = SIM_TCP;
+            port = atoi(optarg);
+            break;
+        case 'u':
+            sim_mode = SIM_UDP;
+            port = atoi(optarg);
+            break;
+        case 'r':
+            ready = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'b':
+            sim_baud = atoi(optarg);
+            break;
+        case 'l':
+            sim_latency_ms = atoi(optarg);
+            break;
+        case 'd':
+            sim_drop_every = atoi(optarg);
+            break;
+        case 'g':
+            if (optind >= argc) {
+                usage();
+            }
+            return sim_gen(argv[optind], strtoul(optarg, NULL, 0)) ? 1 : 0;
+        default:
+            usage();
+        }
+    }
+    if ((!link && !port) || sim_baud <= 0) {
+        usage();
+    }
+    if (file && sim_file_read(file)) {
+        return 1;
+    }
+    if (port) {
+        if (sim_listen(port, ready)) {
+            return 1;
+        }
+    } else if (sim_open(link)) {
+        return 1;
+    }
+    if ((sim_mode == SIM_UDP ? sim_run_udp() : sim_run())) {
+        return 1;
+    }
+    if (link) {
+        unlink(link);
+    }
+    /* file was read from device, nothing uploaded */
+    if (file && !sim_dl_cnt && (sim_img_off != sim_img_sz ||
+        sim_img_sz != sim_ref_sz || memcmp(sim_img, sim_ref, sim_ref_sz))) {
+        fprintf(stderr, "%s: uploaded image does not match %s\n", simname,
+          file);
+        return 1;
+    }
+    return 0;
+}
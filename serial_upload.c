@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 #ifndef WIN32
 #include <unistd.h>
 #include <termios.h>
@@ -38,23 +39,29 @@
 #include "serial_upload.h"
 #include "crc/crc16.h"
 #include "base64/base64.h"
+#include "sha256/sha256.h"
 
 const char *cmdname;
 
-#define TXBUF_SZ 2100
+/*
+ * Upload segment is the chunk of image data, and up to 52 bytes of
+ * nmgr_hdr and CBOR around it.
+ */
+#define IMGCHUNK_MAX 2048
+#define TXBUF_SZ (IMGCHUNK_MAX + 52)
 #define FIRST_SEG_TMO 16
 #define NEXT_SEG_TMO 1
+#define ERASE_TMO 120
+#define ERASE_POLL_MAX 4
+
+/*
+ * Retransmit timeout for segments after the first one, in ms. Adapts to
+ * measured round trip time like TCP does, between these limits.
+ */
+#define RTO_MIN_MS 100
+#define RTO_MAX_MS (NEXT_SEG_TMO * 1000)
 
-struct upload_state {
-    const char *devname;
-    int speed;
-    HANDLE port;
-    const char *filename;
-    size_t file_sz;
-    uint8_t *file;
-    int imgchunk;
-    int verbose;
-} state;
+SESSION_LOCAL struct upload_state state;
 
 void
 dump_hex(const char *hdr, void *bufv, int cnt)
@@ -74,315 +81,2784 @@ dump_hex(const char *hdr, void *bufv, int cnt)
     }
 }
 
-#define SHELL_NLIP_PKT          0x0609
-#define SHELL_NLIP_DATA         0x0414
-#define SHELL_NLIP_MAX_FRAME    128
+static const struct transport *xports[] = {
+    &udp_transport,
+    &tcp_transport,
+    &rfc2217_transport,
+};
 
+/*
+ * Device is either serial port name, or <transport name>:<address>.
+ */
 static int
-port_write(HANDLE fd, uint8_t *buf, size_t len)
+xport_open(const char *devname)
 {
-    uint16_t crc;
-    size_t off = 0;
-    size_t boff;
-    size_t blen;
-    char tmpbuf[512];
-    uint8_t first_b[3];
+    const struct transport *xp;
+    size_t len;
+    int i;
+
+    state.xport = &serial_transport;
+    for (i = 0; i < sizeof(xports) / sizeof(xports[0]); i++) {
+        xp = xports[i];
+        len = strlen(xp->t_name);
+        if (!strncmp(devname, xp->t_name, len) && devname[len] == ':') {
+            state.xport = xp;
+            devname += len + 1;
+            break;
+        }
+    }
+    return state.xport->t_open(devname);
+}
+
+static int
+xport_writev(struct pkt_iov *iov, int iovcnt)
+{
+    return state.xport->t_tx(iov, iovcnt);
+}
+
+static int
+xport_write(uint8_t *buf, size_t len)
+{
+    struct pkt_iov iov;
+
+    iov.pi_base = buf;
+    iov.pi_len = len;
+    return xport_writev(&iov, 1);
+}
+
+static int
+xport_read(uint8_t **bufp, int tmo)
+{
+    return state.xport->t_rx(bufp, time_get_ms() + tmo * 1000);
+}
+
+/*
+ * Device console output, with time since start at the beginning of each
+ * line. In watch mode lines also carry the port name.
+ */
+static FILE *console_fp;
+static uint32_t console_start_ms;
+static SESSION_LOCAL const char *console_dev;
+
+static void
+console_out(const char *data, size_t len, int bol)
+{
+    uint32_t ms;
 
-    crc = crc16_ccitt(CRC16_INITIAL_CRC, buf, len);
-    crc = htons(crc);
-    memcpy(buf + len, &crc, sizeof(crc));
-    len += sizeof(uint16_t);
+    if (bol) {
+        ms = time_get_ms() - console_start_ms;
+        fprintf(console_fp, "[%5u.%03u] ", ms / 1000, ms % 1000);
+        if (console_dev) {
+            fprintf(console_fp, "%s: ", console_dev);
+        }
+    }
+    fwrite(data, 1, len, console_fp);
+    if (data[len - 1] == '\n') {
+        fflush(console_fp);
+    }
+}
 
-    if (state.verbose > 1) {
-        dump_hex("TX unencoded", buf, len);
+static int
+console_open(const char *name)
+{
+    if (!strcmp(name, "-")) {
+        console_fp = stdout;
+    } else {
+        console_fp = fopen(name, "w");
+        if (!console_fp) {
+            fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+              strerror(errno));
+            return -1;
+        }
     }
-    while (off < len) {
-        if (off == 0) {
-            ((unsigned short *)tmpbuf)[0] = htons(SHELL_NLIP_PKT);
-            ((unsigned short *)first_b)[0] = htons(len);
-            first_b[2] = buf[0];
-            boff = 2;
-            off = 1;
-            boff += base64_encode(first_b, 3, &tmpbuf[2], 0);
-            blen = 90;
+    console_start_ms = time_get_ms();
+    nlip_console_attach(console_out);
+    return 0;
+}
+
+static int
+echo_ctl(int val)
+{
+    uint8_t buf[512];
+    uint8_t *rsp;
+    size_t cnt;
+    int rc;
+
+    cnt = serial_uploader_echo_ctl(buf, sizeof(buf), 0);
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return (int)cnt;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = xport_read(&rsp, 2);
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    return 0;
+}
+
+static void
+upload_stats_print(void)
+{
+    struct upload_stats *us = &state.stats;
+    uint32_t ms;
+
+    ms = time_get_ms() - us->start_ms;
+    if (ms == 0) {
+        ms = 1;
+    }
+    fprintf(stdout, "%zu bytes in %u.%03us (%llu B/s), "
+      "%zu bytes written in %d pkts",
+      state.file_sz, ms / 1000, ms % 1000,
+      (unsigned long long)state.file_sz * 1000 / ms,
+      us->tx_bytes, us->tx_pkts);
+    if (us->tx_lines) {
+        fprintf(stdout, "/%d lines of %d", us->tx_lines, state.linelen);
+    }
+    fprintf(stdout, " (%zu%% of %s), %d retransmits",
+      state.file_sz ? us->tx_bytes * 100 / state.file_sz : 0,
+      state.fs_name ? "file" : "image", us->retransmits);
+    if (us->tx_pkts) {
+        fprintf(stdout, " (%d.%d%%)", us->retransmits * 100 / us->tx_pkts,
+          us->retransmits * 1000 / us->tx_pkts % 10);
+    }
+    if (us->stale_acks) {
+        fprintf(stdout, ", %d stale acks", us->stale_acks);
+    }
+    if (us->tx_stalls) {
+        fprintf(stdout, ", %d write stalls", us->tx_stalls);
+    }
+    if (us->erase_ms) {
+        fprintf(stdout, ", erase %u.%03us",
+          us->erase_ms / 1000, us->erase_ms % 1000);
+    }
+    fprintf(stdout, "\n");
+}
+
+/*
+ * Segment ready to be sent. First segment is encoded in full, rest of them
+ * are the template header + pointer to file data. File uploads are read
+ * from disk a segment at a time, to ut_data.
+ */
+struct upload_tx {
+    struct segx_tmpl ut_tmpl;
+    uint8_t ut_seg0[TXBUF_SZ];
+    uint8_t ut_data[TXBUF_SZ];
+    struct pkt_iov ut_iov[SEGX_IOV_CNT];
+    uint8_t *ut_hdr;                    /* nmgr header, within above */
+    int ut_iovcnt;
+    int ut_blen;
+    size_t ut_off;                      /* UPLOAD_TX_NONE if not encoded */
+};
+
+#define UPLOAD_TX_NONE  ((size_t)-1)
+
+/*
+ * Round trip time estimate, RFC 6298 style.
+ */
+struct upload_rtt {
+    int ur_srtt;
+    int ur_rttvar;
+    int ur_rto;
+};
+
+/*
+ * File being uploaded with the FS group, instead of image in state.file.
+ */
+static SESSION_LOCAL FILE *upload_fp;
+
+static uint8_t *
+img_upload_data(struct upload_tx *tx, size_t off, size_t blen)
+{
+    if (!upload_fp) {
+        return &state.file[off];
+    }
+    if (fseek(upload_fp, off, SEEK_SET) ||
+      fread(tx->ut_data, 1, blen, upload_fp) != blen) {
+        fprintf(stderr, "%s: read %s failed\n", cmdname, state.filename);
+        return NULL;
+    }
+    return tx->ut_data;
+}
+
+static int
+img_upload_tx_prepare(struct upload_tx *tx, size_t off)
+{
+    uint8_t *data;
+    size_t blen;
+    size_t cnt;
+
+    if (off == 0) {
+        blen = 32;
+        if (blen > state.file_sz) {
+            blen = state.file_sz;
+        }
+        data = img_upload_data(tx, off, blen);
+        if (!data) {
+            return -1;
+        }
+        if (upload_fp) {
+            cnt = serial_uploader_fs_seg0(tx->ut_seg0, sizeof(tx->ut_seg0),
+              state.fs_name, state.file_sz, data, blen);
         } else {
-            ((unsigned short *)tmpbuf)[0] = htons(SHELL_NLIP_DATA);
-            boff = 2;
-            blen = 93;
+            cnt = serial_uploader_create_seg0(tx->ut_seg0,
+              sizeof(tx->ut_seg0), state.file_sz, data, blen, state.image);
+        }
+        tx->ut_iov[0].pi_base = tx->ut_seg0;
+        tx->ut_iov[0].pi_len = cnt;
+        tx->ut_iovcnt = 1;
+        tx->ut_hdr = tx->ut_seg0;
+    } else {
+        blen = state.file_sz - off;
+        if (blen > state.segsz) {
+            blen = state.segsz;
+        }
+        data = img_upload_data(tx, off, blen);
+        if (!data) {
+            return -1;
+        }
+        cnt = serial_uploader_segX_tmpl_fill(&tx->ut_tmpl, off, data, blen,
+          tx->ut_iov);
+        tx->ut_iovcnt = SEGX_IOV_CNT;
+        tx->ut_hdr = tx->ut_tmpl.st_hdr;
+    }
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zd\n",
+                cmdname, cnt);
+    } else {
+        if (state.verbose) {
+            fprintf(stdout, " %zu-%zu\n", off, off + blen);
         }
+    }
+    tx->ut_blen = blen;
+    tx->ut_off = off;
+    return cnt;
+}
+
+static void
+upload_rtt_sample(struct upload_rtt *ur, int rtt)
+{
+    int delta;
 
-        if (blen > len - off) {
-            blen = len - off;
+    if (ur->ur_srtt == 0) {
+        ur->ur_srtt = rtt;
+        ur->ur_rttvar = rtt / 2;
+    } else {
+        delta = ur->ur_srtt - rtt;
+        if (delta < 0) {
+            delta = -delta;
         }
-        boff += base64_encode(&buf[off], blen, &tmpbuf[boff], 1);
-        off += blen;
-        tmpbuf[boff++] = '\n';
+        ur->ur_rttvar = (3 * ur->ur_rttvar + delta) / 4;
+        ur->ur_srtt = (7 * ur->ur_srtt + rtt) / 8;
+    }
+    ur->ur_rto = ur->ur_srtt + 4 * ur->ur_rttvar;
+    if (ur->ur_rto < RTO_MIN_MS) {
+        ur->ur_rto = RTO_MIN_MS;
+    }
+    if (ur->ur_rto > RTO_MAX_MS) {
+        ur->ur_rto = RTO_MAX_MS;
+    }
+}
 
-        if (state.verbose > 1) {
-            dump_hex("TX encoded", tmpbuf, boff);
+/*
+ * Reads the ack for segment sent with sequence number seq. Responses with
+ * other sequence numbers are to earlier transmissions of the same or
+ * previous segment, and get dropped.
+ */
+static int
+img_upload_ack_read(uint8_t **rxbuf, uint8_t seq, uint32_t end_ms)
+{
+    int rxcnt;
+
+    while (1) {
+        rxcnt = state.xport->t_rx(rxbuf, end_ms);
+        if (rxcnt < 0 || serial_uploader_rsp_seq(*rxbuf, rxcnt) == seq) {
+            return rxcnt;
         }
-	if (port_write_data(fd, tmpbuf, boff) < 0) {
-            return -1;
+        state.stats.stale_acks++;
+        if (state.verbose > 1) {
+            fprintf(stdout, "stale ack dropped\n");
         }
     }
+}
 
-    return 0;
+static int
+img_erase_req(int erase_state)
+{
+    uint8_t buf[64];
+    size_t cnt;
+    int rc;
+
+    if (erase_state) {
+        cnt = serial_uploader_image_erase_state(buf, sizeof(buf));
+    } else {
+        cnt = serial_uploader_image_erase(buf, sizeof(buf));
+    }
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return (int)cnt;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+    }
+    return rc;
 }
 
+/*
+ * Waits for the slot erase started with img_erase_req() to finish.
+ * Device handles one request at a time, so erase state request gets
+ * answered only after erase is done. Poll with those while waiting, as
+ * the response to erase itself could get lost on datagram transports.
+ */
 static int
-port_read_pkt_len(char *buf, int len)
+img_erase_wait(uint32_t start_ms)
 {
-    int i;
+    uint8_t *rsp;
+    size_t off;
+    int pending = 1;
+    int polls = 0;
+    int rc;
 
-    for (i = 0; i < len; i++) {
-        if (buf[i] == '\n') {
-            return i + 1;
+    while (1) {
+        rc = xport_read(&rsp, NEXT_SEG_TMO);
+        if (rc == -14) {
+            if ((int32_t)(time_get_ms() - start_ms) > ERASE_TMO * 1000) {
+                fprintf(stderr, "%s: slot erase timed out\n", cmdname);
+                return rc;
+            }
+            if (polls < ERASE_POLL_MAX) {
+                rc = img_erase_req(1);
+                if (rc < 0) {
+                    return rc;
+                }
+                polls++;
+                pending++;
+            }
+            if (!state.verbose) {
+                fprintf(stdout, ".");
+                fflush(stdout);
+            }
+            continue;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "read fail %d\n", rc);
+            return rc;
+        }
+        pending--;
+        rc = serial_uploader_decode_rsp(rsp, rc, &off);
+        if (rc < 0) {
+            fprintf(stderr, "%s: response decoding issue %d\n",
+              cmdname, rc);
+            return rc;
+        } else if (rc > 0) {
+            fprintf(stderr, "%s: newtmgr error response %d\n",
+              cmdname, rc);
+            return -5;
         }
+        break;
+    }
+    state.stats.erase_ms = time_get_ms() - start_ms;
+    if (state.verbose) {
+        fprintf(stdout, "Slot erased in %u ms\n", state.stats.erase_ms);
+    }
+
+    /*
+     * Drain responses to remaining polls, so they're not taken as
+     * acks for upload.
+     */
+    while (pending > 0 && xport_read(&rsp, NEXT_SEG_TMO) >= 0) {
+        pending--;
     }
     return 0;
 }
 
 static int
-port_read(HANDLE fd, uint8_t *buf, size_t maxlen, int tmo)
+img_upload_run(struct upload_tx *tx)
 {
-    int end_time, now;
-    char tmpbuf[512];
+    struct upload_tx *cur;
+    struct upload_tx *next;
+    struct upload_tx *tmp;
+    struct upload_rtt rtt;
+    uint8_t *rxbuf;
+    uint32_t sent_ms;
+    uint32_t end_ms;
+    uint8_t seq = 0;
+    int retx = 0;
+    int erase;
+    int rxcnt;
     int rc;
-    int off;
-    int len;
-    int soff;
+    size_t off;
+    size_t next_off;
+
+    /*
+     * Data is base64 encoded on serial. Leave 16 bytes for rest of the CBOR
+     * payload. CBOR has [ 'off':<number> 'data':<imgchunk> ]
+     */
+    state.segsz = state.imgchunk;
+    if (state.xport->t_b64) {
+        state.segsz = state.segsz * 3 / 4;
+    }
+    state.segsz -= 16;
+    if (state.verbose) {
+        fprintf(stdout, "Starting upload %zu bytes\n", state.file_sz);
+    }
+    memset(&state.stats, 0, sizeof(state.stats));
+    state.stats.start_ms = time_get_ms();
 
-    now = time_get();
-    end_time = now + tmo;
+    /*
+     * With explicit erase, prepare the upload while device is busy erasing.
+     */
+    erase = state.erase && !upload_fp;
+    if (erase) {
+        rc = img_erase_req(0);
+        if (rc < 0) {
+            return rc;
+        }
+    }
 
-    soff = 0;
-    off = 0;
-    while (1) {
-        if (soff == off) {
-            soff = off = 0;
+    if (upload_fp) {
+        rc = serial_uploader_fs_tmpl_init(&tx[0].ut_tmpl) ||
+          serial_uploader_fs_tmpl_init(&tx[1].ut_tmpl);
+    } else {
+        rc = serial_uploader_segX_tmpl_init(&tx[0].ut_tmpl) ||
+          serial_uploader_segX_tmpl_init(&tx[1].ut_tmpl);
+    }
+    if (rc) {
+        fprintf(stderr, "%s: message encoding issue\n", cmdname);
+        return -1;
+    }
+    cur = &tx[0];
+    next = &tx[1];
+
+    memset(&rtt, 0, sizeof(rtt));
+    rtt.ur_rto = RTO_MAX_MS;
+    next->ut_off = UPLOAD_TX_NONE;
+    if (img_upload_tx_prepare(cur, 0) < 0) {
+        return -1;
+    }
+    if (erase) {
+        rc = img_erase_wait(state.stats.start_ms);
+        if (rc < 0) {
+            return rc;
         }
-        rc = port_read_poll(fd, &tmpbuf[off], maxlen - off, end_time,
-                            state.verbose);
+    }
+    while (1) {
+        off = cur->ut_off;
+        serial_uploader_seq_set(cur->ut_hdr, ++seq);
+        rc = xport_writev(cur->ut_iov, cur->ut_iovcnt);
         if (rc < 0) {
-            break;
+            fprintf(stderr, "write fail %d\n", rc);
+            return rc;
         }
+        sent_ms = time_get_ms();
         if (off == 0) {
-            while (rc > 0 && (tmpbuf[0] == '\r' || tmpbuf[0] == '\n')) {
-                memmove(tmpbuf, &tmpbuf[1], rc - 1);
-                rc = rc - 1;
-            }
+            end_ms = sent_ms + FIRST_SEG_TMO * 1000;
+        } else {
+            end_ms = sent_ms + rtt.ur_rto;
         }
-        off += rc;
-        while ((len = port_read_pkt_len(&tmpbuf[soff], off - soff))) {
-            if (len > 2) {
-                assert(soff + len < maxlen);
-                if (*((unsigned short *)&tmpbuf[soff]) ==
-                  htons(SHELL_NLIP_PKT)) {
 
-                    tmpbuf[soff + len] = '\0';
-                    rc = base64_decode(&tmpbuf[soff + 2], &tmpbuf[soff + 2]);
-                    rc -= sizeof(unsigned short);
-                    if (rc < 0) {
-                        return -4;
-                    }
-                    if (rc != htons(*(unsigned short *)&tmpbuf[soff + 2])) {
-                        return -5;
-                    }
-                    memcpy(buf, &tmpbuf[soff + 4], rc);
-                    if (serial_uploader_is_rsp(buf, rc)) {
-                        return rc;
-                    }
-                }
+        /*
+         * Encode the following segment while this one is on its way.
+         */
+        if (off + cur->ut_blen < state.file_sz &&
+          next->ut_off != off + cur->ut_blen &&
+          img_upload_tx_prepare(next, off + cur->ut_blen) < 0) {
+            return -1;
+        }
+        rxcnt = img_upload_ack_read(&rxbuf, seq, end_ms);
+        if (rxcnt == -14) {
+            /*
+             * Back off, and send the same segment again.
+             */
+            state.stats.retransmits++;
+            rtt.ur_rto *= 2;
+            if (rtt.ur_rto > RTO_MAX_MS) {
+                rtt.ur_rto = RTO_MAX_MS;
             }
-            soff += len;
+            retx = 1;
+            continue;
+        }
+        if (rxcnt < 0) {
+            fprintf(stderr, "read fail %d\n", rxcnt);
+            return rxcnt;
+        }
+        rc = serial_uploader_decode_rsp(rxbuf, rxcnt, &next_off);
+        if (rc < 0) {
+            fprintf(stderr, "%s: response decoding issue %d\n",
+              cmdname, rc);
+            return rc;
+        } else if (rc > 0) {
+            fprintf(stderr, "%s: newtmgr error response %d\n",
+              cmdname, rc);
+            return -5;
+        }
+        if (!retx && off != 0) {
+            upload_rtt_sample(&rtt, time_get_ms() - sent_ms);
+        }
+        retx = 0;
+	if (state.verbose) {
+            fprintf(stdout, "ack to %zu\n", next_off);
+	} else {
+            fprintf(stdout, ".");
+            fflush(stdout);
+        }
+        if (next_off == state.file_sz) {
+            break;
+        }
+        if (next_off > state.file_sz) {
+            fprintf(stderr, "%s: offset %zu larger than file %zu\n",
+              cmdname, next_off, state.file_sz);
+            return -1;
+        }
+
+        /*
+         * Continue from where device says it is; usually that is the
+         * segment already encoded in next.
+         */
+        if (next_off == next->ut_off) {
+            tmp = cur;
+            cur = next;
+            next = tmp;
+        } else if (next_off != cur->ut_off) {
+            if (state.verbose) {
+                fprintf(stdout, "jump from %zu to %zu\n",
+                  off + cur->ut_blen, next_off);
+            }
+            state.stats.retransmits++;
+            if (next_off == 0) {
+                next->ut_off = UPLOAD_TX_NONE;
+                if (img_upload_tx_prepare(cur, 0) < 0) {
+                    return -1;
+                }
+            } else {
+                if (img_upload_tx_prepare(next, next_off) < 0) {
+                    return -1;
+                }
+                tmp = cur;
+                cur = next;
+                next = tmp;
+            }
+        } else {
+            state.stats.retransmits++;
+        }
+    }
+    if (state.verbose) {
+        fprintf(stdout, "Upload complete\n");
+    } else {
+        fprintf(stdout, "\n");
+    }
+    upload_stats_print();
+    return 0;
+}
+
+/*
+ * Segment buffers are taken from the arena for the duration of upload.
+ */
+static int
+img_upload(void)
+{
+    struct upload_tx *tx;
+    size_t mark;
+    int rc;
+
+    mark = arena_mark();
+    tx = arena_alloc(2 * sizeof(*tx));
+    if (!tx) {
+        return -1;
+    }
+    rc = img_upload_run(tx);
+    arena_release(mark);
+    return rc;
+}
+
+/*
+ * Reads image state from the device. Returns newtmgr error from the
+ * device as is, without reporting it.
+ */
+static int
+img_state_read(struct image_slot_state *slots, int *nslots)
+{
+    uint8_t buf[64];
+    uint8_t *rsp;
+    size_t cnt;
+    int rc;
+
+    cnt = serial_uploader_image_state(buf, sizeof(buf));
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return (int)cnt;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = xport_read(&rsp, 2);
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    *nslots = IMG_SLOT_MAX;
+    rc = serial_uploader_decode_image_state(rsp, rc, slots, nslots);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+    }
+    return rc;
+}
+
+static int
+img_slot_find(struct image_slot_state *slots, int nslots, const uint8_t *hash)
+{
+    int i;
+
+    for (i = 0; i < nslots; i++) {
+        if (slots[i].is_hash_len == IMG_HASH_LEN &&
+          !memcmp(slots[i].is_hash, hash, IMG_HASH_LEN)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Checks that one of the slots holds the image we sent.
+ */
+static int
+img_verify(void)
+{
+    struct image_slot_state slots[IMG_SLOT_MAX];
+    const uint8_t *hash = state.img_hash;
+    int nslots;
+    int rc;
+    int i;
+
+    rc = img_state_read(slots, &nslots);
+    if (rc < 0) {
+        return rc;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
+    i = img_slot_find(slots, nslots, hash);
+    if (i >= 0) {
+        if (state.verbose) {
+            fprintf(stdout, "Image verified, slot %d version %s\n",
+              slots[i].is_slot, slots[i].is_version);
+        }
+        return 0;
+    }
+    fprintf(stderr, "%s: image hash not found on device\n", cmdname);
+    dump_hex("Local hash", (void *)hash, IMG_HASH_LEN);
+    for (i = 0; i < nslots; i++) {
+        fprintf(stdout, "Slot %d version %s ", slots[i].is_slot,
+          slots[i].is_version);
+        dump_hex("hash", slots[i].is_hash, slots[i].is_hash_len);
+    }
+    return -1;
+}
+
+/*
+ * Uploads image from a file, unless device has it already. File is checked
+ * to be a complete image before anything is sent; its hash is taken from
+ * the TLVs for dedupe and verify. With -n file is sent as is, for images
+ * this can't parse, and so also without dedupe and verify.
+ */
+static int
+img_upload_file(const char *name)
+{
+    struct image_slot_state slots[IMG_SLOT_MAX];
+    struct img_info ii;
+    int nslots;
+    int rc;
+    int i;
+
+    rc = file_map(name, &state.file_sz, &state.file);
+    if (rc < 0) {
+        return rc;
+    }
+    if (state.no_check) {
+        if (state.verify) {
+            fprintf(stderr, "%s: %s not checked, can't verify it\n", cmdname,
+              name);
+        }
+        goto upload;
+    }
+    rc = img_validate(name, state.file, state.file_sz, &ii);
+    if (rc < 0) {
+        fprintf(stderr, "%s: not uploading %s, -n sends it as is\n",
+          cmdname, name);
+        goto out;
+    }
+    state.img_hash = ii.ii_hash;
+    if (state.verbose) {
+        fprintf(stdout, "Image %s version %s, %" PRIu32 " bytes\n", name,
+          ii.ii_version, ii.ii_img_size);
+    }
+
+    /*
+     * Failing query is not a reason to skip upload; device might not
+     * report image state at all.
+     */
+    if (img_state_read(slots, &nslots) == 0) {
+        i = img_slot_find(slots, nslots, ii.ii_hash);
+        if (i >= 0) {
+            fprintf(stdout, "%s already in slot %d, not uploading\n",
+              name, slots[i].is_slot);
+            goto out;
+        }
+    }
+
+upload:
+    if (state.manifest) {
+        fprintf(stdout, "Uploading %s\n", name);
+    }
+    rc = img_upload();
+    if (rc == 0 && state.verify && state.img_hash) {
+        rc = img_verify();
+    }
+out:
+    file_unmap(state.file, state.file_sz);
+    state.file = NULL;
+    state.img_hash = NULL;
+    return rc;
+}
+
+static int
+reset_device(void)
+{
+    uint8_t buf[512];
+    uint8_t *rsp;
+    size_t cnt;
+    int rc;
+
+    cnt = serial_uploader_reset(buf, sizeof(buf), 0);
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return (int)cnt;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = xport_read(&rsp, 2);
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    if (state.verbose) {
+        fprintf(stdout, "Device reset\n");
+    }
+    return 0;
+}
+
+/*
+ * Download of core dump, or file with the FS group. Device decides the
+ * chunk size; the first chunk, which also has the total size, is read on
+ * its own. After that DL_WINDOW reads are kept in flight. Chunks are
+ * written to the file in order, so a partial file can be resumed from
+ * its end. A read is sent at most NMGR_TRIES times before giving up.
+ */
+#define DL_WINDOW               4
+#define DL_CHUNK_MAX            NLIP_LINE_MAX
+
+#define NMGR_TRIES              4
+
+#define MGMT_ERR_ENOENT         5
+#define MGMT_ERR_ENOTSUP        8
+
+struct dl_slot {
+    size_t ds_off;                      /* DL_SLOT_FREE if unused */
+    size_t ds_len;                      /* DL_SLOT_PENDING if no data */
+    uint8_t ds_seq;
+    uint8_t ds_tries;                   /* times ds_off has been sent */
+    uint32_t ds_sent_ms;
+    uint8_t ds_data[DL_CHUNK_MAX];
+};
+
+#define DL_SLOT_FREE            ((size_t)-1)
+#define DL_SLOT_PENDING         ((size_t)-1)
+
+struct download {
+    const char *dl_name;                /* file on device, NULL for core */
+    struct dl_slot dl_slots[DL_WINDOW];
+    size_t dl_total;
+    size_t dl_stride;
+    size_t dl_wr_off;                   /* written to file */
+    size_t dl_next_off;                 /* next to request */
+    uint8_t dl_seq;
+    int dl_reqs;
+    int dl_retx;
+    int dl_noent;                       /* file not on device */
+};
+
+static int
+core_list(void)
+{
+    uint8_t buf[64];
+    uint8_t *rsp;
+    size_t cnt;
+    size_t off;
+    int rc;
+
+    cnt = serial_uploader_core_list(buf, sizeof(buf));
+    if (cnt < 0 || cnt > sizeof(buf)) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return -1;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = xport_read(&rsp, 2);
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    rc = serial_uploader_decode_rsp(rsp, rc, &off);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc == MGMT_ERR_ENOENT) {
+        return 0;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
+    return 1;
+}
+
+static int
+dl_req(struct download *dl, size_t off)
+{
+    uint8_t buf[256];
+    size_t cnt;
+    int rc;
+
+    if (dl->dl_name) {
+        cnt = serial_uploader_fs_download(buf, sizeof(buf), dl->dl_name, off);
+    } else {
+        cnt = serial_uploader_core_load(buf, sizeof(buf), off);
+    }
+    if (cnt < 0 || cnt > sizeof(buf)) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return -1;
+    }
+    serial_uploader_seq_set(buf, ++dl->dl_seq);
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    dl->dl_reqs++;
+    return 0;
+}
+
+static int
+dl_slot_send(struct download *dl, struct dl_slot *ds, size_t off)
+{
+    if (ds->ds_off != off) {
+        ds->ds_tries = 0;
+    }
+    ds->ds_tries++;
+    ds->ds_off = off;
+    ds->ds_len = DL_SLOT_PENDING;
+    ds->ds_sent_ms = time_get_ms();
+    if (dl_req(dl, off)) {
+        return -1;
+    }
+    ds->ds_seq = dl->dl_seq;
+    return 0;
+}
+
+/*
+ * Puts slot to use for the next read. That is the data right after what
+ * has been written, if device returned a short chunk and nothing covers
+ * it yet.
+ */
+static int
+dl_slot_refill(struct download *dl, struct dl_slot *ds)
+{
+    int i;
+
+    ds->ds_off = DL_SLOT_FREE;
+    if (dl->dl_next_off < dl->dl_wr_off) {
+        dl->dl_next_off = dl->dl_wr_off;
+    }
+    if (dl->dl_wr_off < dl->dl_next_off && dl->dl_wr_off < dl->dl_total) {
+        for (i = 0; i < DL_WINDOW; i++) {
+            if (dl->dl_slots[i].ds_off == dl->dl_wr_off) {
+                break;
+            }
+        }
+        if (i == DL_WINDOW) {
+            return dl_slot_send(dl, ds, dl->dl_wr_off);
+        }
+    }
+    if (dl->dl_next_off >= dl->dl_total) {
+        return 0;
+    }
+    dl->dl_next_off += dl->dl_stride;
+    return dl_slot_send(dl, ds, dl->dl_next_off - dl->dl_stride);
+}
+
+/*
+ * Writes slots which continue from where the file ends, and reuses them.
+ */
+static int
+dl_flush(struct download *dl, FILE *fp)
+{
+    struct dl_slot *ds;
+    size_t cnt;
+    int progress;
+    int i;
+
+    do {
+        progress = 0;
+        for (i = 0; i < DL_WINDOW; i++) {
+            ds = &dl->dl_slots[i];
+            if (ds->ds_off == DL_SLOT_FREE ||
+              ds->ds_len == DL_SLOT_PENDING || ds->ds_off > dl->dl_wr_off) {
+                continue;
+            }
+            if (ds->ds_off + ds->ds_len > dl->dl_wr_off) {
+                cnt = ds->ds_off + ds->ds_len - dl->dl_wr_off;
+                if (cnt > dl->dl_total - dl->dl_wr_off) {
+                    cnt = dl->dl_total - dl->dl_wr_off;
+                }
+                if (fwrite(&ds->ds_data[dl->dl_wr_off - ds->ds_off], cnt, 1,
+                    fp) != 1) {
+                    return -2;
+                }
+                dl->dl_wr_off += cnt;
+                if (!state.verbose) {
+                    fprintf(stdout, ".");
+                    fflush(stdout);
+                }
+            }
+            if (dl_slot_refill(dl, ds)) {
+                return -1;
+            }
+            progress = 1;
+        }
+    } while (progress);
+    return 0;
+}
+
+/*
+ * Reads the first chunk to buf. Returns its length, and fills in total.
+ */
+static int
+dl_first(struct download *dl, uint8_t *buf, size_t sz)
+{
+    struct dl_chunk dc;
+    uint8_t *rsp;
+    int tries;
+    int rc;
+
+    for (tries = 0; tries < NMGR_TRIES; tries++) {
+        if (tries) {
+            dl->dl_retx++;
+        }
+        rc = dl_req(dl, 0);
+        if (rc < 0) {
+            return rc;
+        }
+        rc = img_upload_ack_read(&rsp, dl->dl_seq,
+          time_get_ms() + NEXT_SEG_TMO * 1000);
+        if (rc != -14) {
+            break;
+        }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    dc.dc_data = buf;
+    dc.dc_len = sz;
+    rc = serial_uploader_decode_chunk(rsp, rc, &dc);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc == MGMT_ERR_ENOENT && dl->dl_name) {
+        dl->dl_noent = 1;
+        return -5;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
+    if (!dc.dc_total_valid || dc.dc_off != 0 ||
+      (dc.dc_len == 0 && dc.dc_total != 0)) {
+        fprintf(stderr, "%s: unexpected download response\n", cmdname);
+        return -1;
+    }
+    dl->dl_total = dc.dc_total;
+    if (dc.dc_len > dl->dl_total) {
+        dc.dc_len = dl->dl_total;
+    }
+    return dc.dc_len;
+}
+
+/*
+ * Opens file for the download. Existing file is continued if it starts
+ * with the same data, and is not longer than the data on device.
+ */
+static FILE *
+dl_file_open(const char *name, struct download *dl, uint8_t *chunk0)
+{
+    uint8_t cmp[DL_CHUNK_MAX];
+    long len = -1;
+    FILE *fp;
+
+    fp = fopen(name, "r+b");
+    if (fp) {
+        if (fseek(fp, 0, SEEK_END) == 0) {
+            len = ftell(fp);
+        }
+        rewind(fp);
+        if (len >= (long)dl->dl_stride && len <= (long)dl->dl_total &&
+          fread(cmp, dl->dl_stride, 1, fp) == 1 &&
+          !memcmp(cmp, chunk0, dl->dl_stride) &&
+          fseek(fp, len, SEEK_SET) == 0) {
+            dl->dl_wr_off = len;
+            return fp;
+        }
+        fclose(fp);
+    }
+    fp = fopen(name, "w+b");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return NULL;
+    }
+    if (dl->dl_stride && fwrite(chunk0, dl->dl_stride, 1, fp) != 1) {
+        fprintf(stderr, "%s: write %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+    dl->dl_wr_off = dl->dl_stride;
+    return fp;
+}
+
+/*
+ * Downloads to file name, or to fp if one is given. Returns 1 if the
+ * file is not on device.
+ */
+static int
+dl_run(const char *dev_name, const char *name, FILE *fp)
+{
+    struct download dl;
+    struct dl_slot *ds;
+    struct upload_rtt rtt;
+    struct dl_chunk dc;
+    uint8_t chunk0[DL_CHUNK_MAX];
+    uint8_t *rsp;
+    uint32_t start_ms;
+    uint32_t end_ms;
+    uint32_t ms;
+    size_t resumed;
+    int rc;
+    int i;
+
+    memset(&dl, 0, sizeof(dl));
+    dl.dl_name = dev_name;
+    memset(&state.stats, 0, sizeof(state.stats));
+    start_ms = time_get_ms();
+
+    rc = dl_first(&dl, chunk0, sizeof(chunk0));
+    if (rc < 0) {
+        return dl.dl_noent ? 1 : rc;
+    }
+    dl.dl_stride = rc;
+    if (fp) {
+        if (dl.dl_stride && fwrite(chunk0, dl.dl_stride, 1, fp) != 1) {
+            goto write_err;
+        }
+        dl.dl_wr_off = dl.dl_stride;
+    } else {
+        fp = dl_file_open(name, &dl, chunk0);
+        if (!fp) {
+            return -1;
+        }
+    }
+    resumed = 0;
+    if (dl.dl_wr_off > dl.dl_stride) {
+        resumed = dl.dl_wr_off;
+        fprintf(stdout, "Resuming download to %s at %zu\n", name, resumed);
+    }
+    if (state.verbose) {
+        fprintf(stdout, "%s %zu bytes, %zu byte chunks\n",
+          dev_name ? dev_name : "Core dump",
+          dl.dl_total, dl.dl_stride);
+    }
+
+    memset(&rtt, 0, sizeof(rtt));
+    rtt.ur_rto = RTO_MAX_MS;
+    dl.dl_next_off = dl.dl_wr_off;
+    for (i = 0; i < DL_WINDOW; i++) {
+        dl.dl_slots[i].ds_off = DL_SLOT_FREE;
+    }
+    for (i = 0; i < DL_WINDOW; i++) {
+        rc = dl_slot_refill(&dl, &dl.dl_slots[i]);
+        if (rc < 0) {
+            goto out;
+        }
+    }
+
+    while (dl.dl_wr_off < dl.dl_total) {
+        /*
+         * Wait until the oldest outstanding read times out.
+         */
+        end_ms = time_get_ms() + rtt.ur_rto;
+        for (i = 0; i < DL_WINDOW; i++) {
+            ds = &dl.dl_slots[i];
+            if (ds->ds_off != DL_SLOT_FREE &&
+              ds->ds_len == DL_SLOT_PENDING &&
+              (int32_t)(ds->ds_sent_ms + rtt.ur_rto - end_ms) < 0) {
+                end_ms = ds->ds_sent_ms + rtt.ur_rto;
+            }
+        }
+        rc = state.xport->t_rx(&rsp, end_ms);
+        if (rc == -14) {
+            for (i = 0; i < DL_WINDOW; i++) {
+                ds = &dl.dl_slots[i];
+                if (ds->ds_off != DL_SLOT_FREE &&
+                  ds->ds_len == DL_SLOT_PENDING &&
+                  (int32_t)(time_get_ms() - ds->ds_sent_ms) >= rtt.ur_rto) {
+                    if (ds->ds_tries >= NMGR_TRIES) {
+                        fprintf(stderr, "read fail %d\n", rc);
+                        goto out;
+                    }
+                    rc = dl_slot_send(&dl, ds, ds->ds_off);
+                    if (rc < 0) {
+                        goto out;
+                    }
+                    dl.dl_retx++;
+                }
+            }
+            rtt.ur_rto *= 2;
+            if (rtt.ur_rto > RTO_MAX_MS) {
+                rtt.ur_rto = RTO_MAX_MS;
+            }
+            continue;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "read fail %d\n", rc);
+            goto out;
+        }
+        for (i = 0; i < DL_WINDOW; i++) {
+            ds = &dl.dl_slots[i];
+            if (ds->ds_off != DL_SLOT_FREE &&
+              ds->ds_len == DL_SLOT_PENDING &&
+              serial_uploader_rsp_seq(rsp, rc) == ds->ds_seq) {
+                break;
+            }
+        }
+        if (i == DL_WINDOW) {
+            /* response to a read sent again */
+            state.stats.stale_acks++;
+            continue;
+        }
+        dc.dc_data = ds->ds_data;
+        dc.dc_len = sizeof(ds->ds_data);
+        rc = serial_uploader_decode_chunk(rsp, rc, &dc);
+        if (rc < 0) {
+            fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+            goto out;
+        } else if (rc > 0) {
+            fprintf(stderr, "%s: newtmgr error response %d at %zu\n",
+              cmdname, rc, ds->ds_off);
+            rc = -5;
+            goto out;
+        }
+        if (dc.dc_off != ds->ds_off || dc.dc_len == 0) {
+            fprintf(stderr, "%s: unexpected download response at %zu\n",
+              cmdname, ds->ds_off);
+            rc = -1;
+            goto out;
+        }
+        upload_rtt_sample(&rtt, time_get_ms() - ds->ds_sent_ms);
+        ds->ds_len = dc.dc_len;
+
+        rc = dl_flush(&dl, fp);
+        if (rc == -2) {
+            goto write_err;
+        } else if (rc < 0) {
+            goto out;
+        }
+    }
+
+    fprintf(stdout, "\n");
+    ms = time_get_ms() - start_ms;
+    if (ms == 0) {
+        ms = 1;
+    }
+    fprintf(stdout, "%zu bytes in %u.%03us (%llu B/s), %d reads, "
+      "%d retransmits", dl.dl_total - resumed, ms / 1000, ms % 1000,
+      (unsigned long long)(dl.dl_total - resumed) * 1000 / ms,
+      dl.dl_reqs, dl.dl_retx);
+    if (state.stats.stale_acks) {
+        fprintf(stdout, ", %d stale responses", state.stats.stale_acks);
+    }
+    fprintf(stdout, "\n");
+    if (!name) {
+        return 0;
+    }
+    if (fclose(fp)) {
+        fprintf(stderr, "%s: write %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return -1;
+    }
+    return 0;
+write_err:
+    fprintf(stderr, "%s: write %s failed: %s\n", cmdname,
+      name ? name : "temporary file", strerror(errno));
+    rc = -1;
+out:
+    if (name) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+static int
+core_download(const char *name)
+{
+    int rc;
+
+    rc = core_list();
+    if (rc <= 0) {
+        if (rc == 0) {
+            fprintf(stdout, "No core dump on device\n");
+        }
+        return rc;
+    }
+    return dl_run(NULL, name, NULL);
+}
+
+/*
+ * File upload with the FS group. Goes through img_upload(), with data
+ * read from the file as it is sent.
+ */
+static int
+fs_upload(const char *name, const char *dev_name)
+{
+    long len = -1;
+    int rc;
+
+    upload_fp = fopen(name, "rb");
+    if (!upload_fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return -1;
+    }
+    if (fseek(upload_fp, 0, SEEK_END) == 0) {
+        len = ftell(upload_fp);
+    }
+    if (len < 0) {
+        fprintf(stderr, "%s: seek %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        fclose(upload_fp);
+        upload_fp = NULL;
+        return -1;
+    }
+    state.filename = name;
+    state.fs_name = dev_name;
+    state.file = NULL;
+    state.file_sz = len;
+    rc = img_upload();
+    fclose(upload_fp);
+    upload_fp = NULL;
+    state.fs_name = NULL;
+    return rc;
+}
+
+/*
+ * Directory sync with the FS group. Files in the directory are compared
+ * with the ones on device by their SHA-256, and only the ones which differ
+ * are uploaded. Devices which can't hash files have each file downloaded
+ * for comparison instead. Subdirectories are skipped, as the FS group has
+ * no way to create them.
+ */
+#define SYNC_FILES_MAX          128
+#define SYNC_READ_SZ            4096
+
+struct fs_sync {
+    char *fs_names[SYNC_FILES_MAX];     /* from arena */
+    int fs_cnt;
+    int fs_no_hash;                     /* device can't hash files */
+};
+
+static int
+fs_sync_add(const char *name, void *arg)
+{
+    struct fs_sync *fs = arg;
+
+    if (fs->fs_cnt >= SYNC_FILES_MAX) {
+        fprintf(stderr, "%s: more than %d files to sync\n", cmdname,
+          SYNC_FILES_MAX);
+        return -1;
+    }
+    fs->fs_names[fs->fs_cnt] = arena_strdup(name);
+    if (!fs->fs_names[fs->fs_cnt]) {
+        return -1;
+    }
+    fs->fs_cnt++;
+    return 0;
+}
+
+static int
+fs_sync_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+fs_sync_hash(FILE *fp, uint8_t *hash, size_t *len)
+{
+    struct sha256_ctx ctx;
+    size_t mark;
+    uint8_t *buf;
+    size_t cnt;
+    int rc = 0;
+
+    mark = arena_mark();
+    buf = arena_alloc(SYNC_READ_SZ);
+    if (!buf) {
+        return -1;
+    }
+    *len = 0;
+    sha256_init(&ctx);
+    while ((cnt = fread(buf, 1, SYNC_READ_SZ, fp)) > 0) {
+        sha256_update(&ctx, buf, cnt);
+        *len += cnt;
+    }
+    if (ferror(fp)) {
+        rc = -1;
+    } else {
+        sha256_final(&ctx, hash);
+    }
+    arena_release(mark);
+    return rc;
+}
+
+/*
+ * Asks device for the hash of dev_path. Returns 0 if it matches, 1 if it
+ * does not, and 2 if device could not tell.
+ */
+static int
+fs_sync_hash_cmp(const char *dev_path, const uint8_t *hash, size_t len)
+{
+    uint8_t buf[256];
+    uint8_t dev_hash[SHA256_DIGEST_LEN];
+    struct dl_chunk dc;
+    uint8_t *rsp;
+    size_t cnt;
+    int rc;
+
+    cnt = serial_uploader_fs_hash(buf, sizeof(buf), dev_path);
+    if (cnt < 0 || cnt > sizeof(buf)) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return -1;
+    }
+    rc = xport_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = xport_read(&rsp, 2);
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    dc.dc_data = dev_hash;
+    dc.dc_len = sizeof(dev_hash);
+    rc = serial_uploader_decode_chunk(rsp, rc, &dc);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc == MGMT_ERR_ENOENT || rc == MGMT_ERR_ENOTSUP) {
+        /* older devices answer ENOENT to commands they don't have */
+        return 2;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
+    if (!dc.dc_total_valid || dc.dc_total != len ||
+      dc.dc_len != sizeof(dev_hash) || memcmp(dev_hash, hash, dc.dc_len)) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns 0 if file is the same on device, 1 if it differs or is missing.
+ */
+static int
+fs_sync_cmp(struct fs_sync *fs, const char *path, const char *dev_path)
+{
+    uint8_t hash[SHA256_DIGEST_LEN];
+    uint8_t dev_hash[SHA256_DIGEST_LEN];
+    size_t len;
+    size_t dev_len;
+    FILE *fp;
+    int rc;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, path,
+          strerror(errno));
+        return -1;
+    }
+    rc = fs_sync_hash(fp, hash, &len);
+    fclose(fp);
+    if (rc) {
+        fprintf(stderr, "%s: read %s failed: %s\n", cmdname, path,
+          strerror(errno));
+        return -1;
+    }
+
+    if (!fs->fs_no_hash) {
+        rc = fs_sync_hash_cmp(dev_path, hash, len);
+        if (rc != 2) {
+            return rc;
+        }
+    }
+
+    fp = tmpfile();
+    if (!fp) {
+        fprintf(stderr, "%s: tmpfile() failed: %s\n", cmdname,
+          strerror(errno));
+        return -1;
+    }
+    if (state.verbose) {
+        fprintf(stdout, "Reading %s for comparison\n", dev_path);
+    }
+    rc = dl_run(dev_path, NULL, fp);
+    if (rc == 0) {
+        if (!fs->fs_no_hash) {
+            fs->fs_no_hash = 1;
+            fprintf(stdout, "Device can't hash files, comparing contents\n");
+        }
+        rewind(fp);
+        rc = fs_sync_hash(fp, dev_hash, &dev_len);
+        if (rc == 0) {
+            rc = dev_len != len || memcmp(dev_hash, hash, sizeof(hash));
+        } else {
+            fprintf(stderr, "%s: read temporary file failed: %s\n",
+              cmdname, strerror(errno));
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+static int
+fs_sync(const char *dir, const char *dev_dir)
+{
+    struct fs_sync fs;
+    char path[1024];
+    char dev_path[256];
+    const char *sep;
+    uint32_t start_ms;
+    uint32_t ms;
+    size_t mark;
+    int uploaded = 0;
+    int rc;
+    int i;
+
+    memset(&fs, 0, sizeof(fs));
+    mark = arena_mark();
+    start_ms = time_get_ms();
+    rc = dir_list(dir, fs_sync_add, &fs);
+    if (rc) {
+        goto out;
+    }
+    qsort(fs.fs_names, fs.fs_cnt, sizeof(fs.fs_names[0]), fs_sync_name_cmp);
+
+    sep = dev_dir[0] && dev_dir[strlen(dev_dir) - 1] == '/' ? "" : "/";
+    for (i = 0; i < fs.fs_cnt; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, fs.fs_names[i]);
+        snprintf(dev_path, sizeof(dev_path), "%s%s%s", dev_dir, sep,
+          fs.fs_names[i]);
+        rc = fs_sync_cmp(&fs, path, dev_path);
+        if (rc < 0) {
+            goto out;
+        } else if (rc == 0) {
+            if (state.verbose) {
+                fprintf(stdout, "%s unchanged\n", dev_path);
+            }
+            continue;
+        }
+        fprintf(stdout, "Uploading %s to %s\n", path, dev_path);
+        rc = fs_upload(path, dev_path);
+        if (rc) {
+            goto out;
+        }
+        uploaded++;
+    }
+    ms = time_get_ms() - start_ms;
+    fprintf(stdout, "Synced %s to %s in %u.%03us: %d files, %d uploaded, "
+      "%d unchanged\n", dir, dev_dir, ms / 1000, ms % 1000, fs.fs_cnt,
+      uploaded, fs.fs_cnt - uploaded);
+out:
+    arena_release(mark);
+    return rc;
+}
+
+static SESSION_LOCAL uint8_t nmgr_seq;
+
+/*
+ * Sends request, and reads the response to it. Request is sent again if
+ * response does not come in time.
+ */
+static int
+nmgr_xact(uint8_t *buf, size_t cnt, uint8_t **rsp)
+{
+    int tries;
+    int rc;
+
+    for (tries = 0; tries < NMGR_TRIES; tries++) {
+        serial_uploader_seq_set(buf, ++nmgr_seq);
+        rc = xport_write(buf, cnt);
+        if (rc < 0) {
+            fprintf(stderr, "write fail %d\n", rc);
+            return rc;
+        }
+        rc = img_upload_ack_read(rsp, nmgr_seq,
+          time_get_ms() + NEXT_SEG_TMO * 1000);
+        if (rc != -14) {
+            break;
+        }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+    }
+    return rc;
+}
+
+/*
+ * Log read with the logs group. Each log is read separately; device fills
+ * a response with as many entries as fit, from the requested index on, and
+ * reading goes on until no new entries come. Entries are written as JSON
+ * lines.
+ *
+ * Cursor file has the index to continue from, per device and log. A line
+ * "<device> <log> <next index> <last timestamp>" is appended after each
+ * log is read, and the last one for a device and log counts. Appending
+ * lets sessions in watch mode share the file.
+ *
+ * Device is the port name, -d or the one found with -w; newtmgr has no
+ * board identity to key on. Cursor follows the port, so a board moved to
+ * another port starts over, and one swapped in on the same port continues
+ * from where the previous one stopped. Log index going backwards, e.g.
+ * after that swap or a log being cleared, is reported and read restarts.
+ */
+#define LOG_LIST_MAX            16
+
+struct log_read {
+    FILE *lr_fp;
+    const char *lr_dev;
+    uint32_t lr_next;                   /* index to continue from */
+    int64_t lr_ts;                      /* of the last entry */
+    int lr_cnt;                         /* new entries in response */
+};
+
+static uint32_t
+log_cursor_get(const char *name, const char *dev, const char *log)
+{
+    char buf[512];
+    char *line_dev;
+    char *line_log;
+    char *line_idx;
+    char *last;
+    uint32_t index = 0;
+    FILE *fp;
+
+    fp = fopen(name, "r");
+    if (!fp) {
+        return 0;
+    }
+    while (fgets(buf, sizeof(buf), fp)) {
+        line_dev = strtok_r(buf, " \t\r\n", &last);
+        line_log = strtok_r(NULL, " \t\r\n", &last);
+        line_idx = strtok_r(NULL, " \t\r\n", &last);
+        if (line_idx && !strcmp(line_dev, dev) && !strcmp(line_log, log)) {
+            index = strtoul(line_idx, NULL, 0);
+        }
+    }
+    fclose(fp);
+    return index;
+}
+
+static int
+log_cursor_set(const char *name, const char *log, struct log_read *lr)
+{
+    FILE *fp;
+
+    if (fflush(lr->lr_fp)) {
+        fprintf(stderr, "%s: write failed: %s\n", cmdname, strerror(errno));
+        return -1;
+    }
+    fp = fopen(name, "a");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%s %s %" PRIu32 " %" PRId64 "\n", lr->lr_dev, log,
+      lr->lr_next, lr->lr_ts);
+    if (fclose(fp)) {
+        fprintf(stderr, "%s: write %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+json_str(FILE *fp, const char *str, size_t len)
+{
+    unsigned char c;
+    size_t i;
+
+    fputc('"', fp);
+    for (i = 0; i < len; i++) {
+        c = str[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c == '\n') {
+            fputs("\\n", fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static int
+log_entry_out(struct log_entry *le, void *arg)
+{
+    struct log_read *lr = arg;
+    FILE *fp = lr->lr_fp;
+    size_t i;
+
+    if (le->le_index < lr->lr_next) {
+        return 0;
+    }
+    fputs("{\"dev\":", fp);
+    json_str(fp, lr->lr_dev, strlen(lr->lr_dev));
+    fputs(",\"log\":", fp);
+    json_str(fp, le->le_log, strlen(le->le_log));
+    fprintf(fp, ",\"index\":%" PRIu32 ",\"ts\":%" PRId64 ",\"level\":%d,"
+      "\"module\":%d,", le->le_index, le->le_ts, le->le_level,
+      le->le_module);
+    if (le->le_binary) {
+        fputs("\"data\":\"", fp);
+        for (i = 0; i < le->le_msg_len; i++) {
+            fprintf(fp, "%02x", le->le_msg[i]);
+        }
+        fputs("\"}\n", fp);
+    } else {
+        fputs("\"msg\":", fp);
+        json_str(fp, (char *)le->le_msg, le->le_msg_len);
+        fputs("}\n", fp);
+    }
+    lr->lr_next = le->le_index + 1;
+    lr->lr_ts = le->le_ts;
+    lr->lr_cnt++;
+    return 0;
+}
+
+static int
+log_list(char (*names)[LOG_NAME_MAX], int *cnt)
+{
+    uint8_t buf[64];
+    uint8_t *rsp;
+    size_t len;
+    int rc;
+
+    len = serial_uploader_log_list(buf, sizeof(buf));
+    if (len < 0 || len > sizeof(buf)) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, len);
+        return -1;
+    }
+    rc = nmgr_xact(buf, len, &rsp);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = serial_uploader_decode_log_list(rsp, rc, names, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
+    return 0;
+}
+
+/*
+ * Reads entries of one log, from lr_next on.
+ */
+static int
+log_read(const char *log, struct log_read *lr, int *total)
+{
+    uint8_t buf[128];
+    uint8_t *rsp;
+    uint32_t next_index;
+    size_t cnt;
+    int rc;
+
+    while (1) {
+        cnt = serial_uploader_log_read(buf, sizeof(buf), log, lr->lr_next);
+        if (cnt < 0 || cnt > sizeof(buf)) {
+            fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+            return -1;
+        }
+        rc = nmgr_xact(buf, cnt, &rsp);
+        if (rc < 0) {
+            return rc;
+        }
+        next_index = lr->lr_next;
+        lr->lr_cnt = 0;
+        rc = serial_uploader_decode_logs(rsp, rc, &next_index,
+          log_entry_out, lr);
+        if (rc < 0) {
+            fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+            return rc;
+        } else if (rc > 0) {
+            fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+            return -5;
+        }
+        if (next_index < lr->lr_next) {
+            /* log erased, or device reflashed */
+            fprintf(stdout, "Log index on device is behind cursor, "
+              "reading %s from start\n", log);
+            lr->lr_next = 0;
+            continue;
+        }
+        if (lr->lr_cnt == 0) {
+            return 0;
+        }
+        *total += lr->lr_cnt;
+    }
+}
+
+static int
+logs_read(const char *name, const char *cursor)
+{
+    char logs[LOG_LIST_MAX][LOG_NAME_MAX];
+    struct log_read lr;
+    uint32_t start_ms;
+    uint32_t start;
+    uint32_t ms;
+    int log_cnt = LOG_LIST_MAX;
+    int total = 0;
+    int rc;
+    int i;
+
+    start_ms = time_get_ms();
+    rc = log_list(logs, &log_cnt);
+    if (rc) {
+        return rc;
+    }
+    memset(&lr, 0, sizeof(lr));
+    lr.lr_dev = state.devname;
+    if (!strcmp(name, "-")) {
+        lr.lr_fp = stdout;
+    } else {
+        lr.lr_fp = fopen(name, "a");
+        if (!lr.lr_fp) {
+            fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+              strerror(errno));
+            return -1;
+        }
+    }
+    for (i = 0; i < log_cnt && rc == 0; i++) {
+        lr.lr_next = 0;
+        if (cursor) {
+            lr.lr_next = log_cursor_get(cursor, lr.lr_dev, logs[i]);
+        }
+        start = lr.lr_next;
+        rc = log_read(logs[i], &lr, &total);
+        if (cursor && lr.lr_next != start &&
+          log_cursor_set(cursor, logs[i], &lr)) {
+            rc = -1;
+        }
+    }
+    if (lr.lr_fp != stdout) {
+        if (fclose(lr.lr_fp) && rc == 0) {
+            fprintf(stderr, "%s: write %s failed: %s\n", cmdname, name,
+              strerror(errno));
+            rc = -1;
+        }
+        ms = time_get_ms() - start_ms;
+        fprintf(stdout, "%d log entries from %d logs in %u.%03us\n", total,
+          log_cnt, ms / 1000, ms % 1000);
+    }
+    return rc;
+}
+
+/*
+ * Stats sampling with the stats group. Requests for the groups are encoded
+ * once, and at each interval sent together with only the sequence number
+ * changed. Counters are decoded without allocation to a row, and written
+ * as CSV. Columns are the counters in the first response from each group;
+ * cells are left empty for a group whose response did not come in time.
+ */
+#define STATS_GROUP_MAX         8
+#define STATS_COL_MAX           256
+#define STATS_REQ_MAX           64
+
+struct stats_col {
+    int sc_group;
+    char sc_name[STATS_NAME_MAX];
+    uint64_t sc_val;
+    int sc_valid;
+};
+
+struct stats_sampler {
+    int ss_group_cnt;
+    char *ss_groups[STATS_GROUP_MAX];
+    uint8_t ss_req[STATS_GROUP_MAX][STATS_REQ_MAX];
+    size_t ss_req_len[STATS_GROUP_MAX];
+    uint8_t ss_seq[STATS_GROUP_MAX];
+    int ss_rsp[STATS_GROUP_MAX];        /* response for this sample in */
+    struct stats_col ss_cols[STATS_COL_MAX];
+    int ss_col_cnt;
+    int ss_group;                       /* of response being decoded */
+    int ss_next;                        /* column expected next */
+    int ss_learn;                       /* first response, add columns */
+};
+
+static SESSION_LOCAL struct stats_sampler stats_ss;
+static volatile sig_atomic_t stats_stop;
+
+static void
+stats_sig(int sig)
+{
+    stats_stop = 1;
+}
+
+/*
+ * Ends sampling in all sessions. Threaded sessions leave SIGINT to the
+ * watch loop, which calls this.
+ */
+void
+stats_interrupt(void)
+{
+    stats_stop = 1;
+}
+
+static void
+stats_field(const char *name, uint64_t val, void *arg)
+{
+    struct stats_sampler *ss = arg;
+    struct stats_col *sc;
+    int i;
+
+    if (ss->ss_learn) {
+        if (ss->ss_col_cnt >= STATS_COL_MAX) {
+            return;
+        }
+        i = ss->ss_col_cnt++;
+        ss->ss_cols[i].sc_group = ss->ss_group;
+        strcpy(ss->ss_cols[i].sc_name, name);
+    } else {
+        /* counters come in the same order each time */
+        i = ss->ss_next;
+        if (i >= ss->ss_col_cnt || ss->ss_cols[i].sc_group != ss->ss_group ||
+          strcmp(ss->ss_cols[i].sc_name, name)) {
+            for (i = 0; i < ss->ss_col_cnt; i++) {
+                if (ss->ss_cols[i].sc_group == ss->ss_group &&
+                  !strcmp(ss->ss_cols[i].sc_name, name)) {
+                    break;
+                }
+            }
+            if (i == ss->ss_col_cnt) {
+                return;
+            }
+        }
+    }
+    sc = &ss->ss_cols[i];
+    sc->sc_val = val;
+    sc->sc_valid = 1;
+    ss->ss_next = i + 1;
+}
+
+static int
+stats_decode(struct stats_sampler *ss, int group, uint8_t *rsp, int len)
+{
+    int rc;
+
+    ss->ss_group = group;
+    ss->ss_next = 0;
+    rc = serial_uploader_decode_stats(rsp, len, stats_field, ss);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: stats group %s: newtmgr error response %d\n",
+          cmdname, ss->ss_groups[group], rc);
+        return -5;
+    }
+    return 0;
+}
+
+/*
+ * Encodes requests, and reads the columns from the first responses.
+ */
+static int
+stats_init(struct stats_sampler *ss, char *groups)
+{
+    uint8_t *rsp;
+    size_t cnt;
+    char *name;
+    char *last;
+    int rc;
+    int i;
+
+    memset(ss, 0, sizeof(*ss));
+    for (name = strtok_r(groups, ",", &last); name;
+         name = strtok_r(NULL, ",", &last)) {
+        if (ss->ss_group_cnt >= STATS_GROUP_MAX) {
+            fprintf(stderr, "%s: more than %d stats groups\n", cmdname,
+              STATS_GROUP_MAX);
+            return -1;
+        }
+        i = ss->ss_group_cnt++;
+        ss->ss_groups[i] = name;
+        cnt = serial_uploader_stats_read(ss->ss_req[i], STATS_REQ_MAX, name);
+        if (cnt < 0 || cnt > STATS_REQ_MAX) {
+            fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+            return -1;
+        }
+        ss->ss_req_len[i] = cnt;
+    }
+
+    ss->ss_learn = 1;
+    for (i = 0; i < ss->ss_group_cnt; i++) {
+        rc = nmgr_xact(ss->ss_req[i], ss->ss_req_len[i], &rsp);
+        if (rc < 0) {
+            return rc;
+        }
+        rc = stats_decode(ss, i, rsp, rc);
+        if (rc) {
+            return rc;
+        }
+    }
+    ss->ss_learn = 0;
+    if (ss->ss_col_cnt == STATS_COL_MAX) {
+        fprintf(stderr, "%s: sampling only the first %d counters\n",
+          cmdname, STATS_COL_MAX);
+    }
+    return 0;
+}
+
+/*
+ * Sends requests for one sample, and reads responses until end_ms.
+ * Returns the number of responses which did not come.
+ */
+static int
+stats_sample(struct stats_sampler *ss, uint32_t end_ms)
+{
+    uint8_t *rsp;
+    int missing;
+    int seq;
+    int rc;
+    int i;
+
+    for (i = 0; i < ss->ss_col_cnt; i++) {
+        ss->ss_cols[i].sc_valid = 0;
+    }
+    for (i = 0; i < ss->ss_group_cnt; i++) {
+        serial_uploader_seq_set(ss->ss_req[i], ++nmgr_seq);
+        ss->ss_seq[i] = nmgr_seq;
+        ss->ss_rsp[i] = 0;
+        rc = xport_write(ss->ss_req[i], ss->ss_req_len[i]);
+        if (rc < 0) {
+            fprintf(stderr, "write fail %d\n", rc);
+            return rc;
+        }
+    }
+    missing = ss->ss_group_cnt;
+    while (missing) {
+        rc = state.xport->t_rx(&rsp, end_ms);
+        if (rc == -14) {
+            break;
+        } else if (rc < 0) {
+            fprintf(stderr, "read fail %d\n", rc);
+            return rc;
+        }
+        seq = serial_uploader_rsp_seq(rsp, rc);
+        for (i = 0; i < ss->ss_group_cnt; i++) {
+            if (ss->ss_seq[i] == seq && !ss->ss_rsp[i]) {
+                break;
+            }
+        }
+        if (i == ss->ss_group_cnt) {
+            /* late response to an earlier sample */
+            state.stats.stale_acks++;
+            continue;
+        }
+        ss->ss_rsp[i] = 1;
+        missing--;
+        rc = stats_decode(ss, i, rsp, rc);
+        if (rc) {
+            return rc;
+        }
+    }
+    return missing;
+}
+
+/*
+ * Samples every interval ms, count times, or until interrupted if count
+ * is 0.
+ */
+static int
+stats_run(const char *name, const char *groups, int interval, int count)
+{
+    struct stats_sampler *ss = &stats_ss;
+    struct stats_col *sc;
+    char group_buf[256];
+    uint32_t start_ms;
+    uint32_t next_ms;
+    uint32_t now;
+    uint32_t ms;
+    void (*old_sig)(int);
+    FILE *fp;
+    int missing = 0;
+    int samples;
+    int rc;
+    int i;
+
+    if (strlen(groups) >= sizeof(group_buf)) {
+        fprintf(stderr, "%s: stats group list too long\n", cmdname);
+        return -1;
+    }
+    strcpy(group_buf, groups);
+
+    /* earlier samples are kept, a rerun needs a new name */
+    if (!strcmp(name, "-")) {
+        fp = stdout;
+    } else {
+        fp = fopen(name, "wx");
+        if (!fp && errno == EEXIST) {
+            fprintf(stderr, "%s: %s exists, not overwriting\n", cmdname,
+              name);
+            return -1;
+        } else if (!fp) {
+            fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+              strerror(errno));
+            return -1;
+        }
+    }
+    rc = stats_init(ss, group_buf);
+    if (rc) {
+        if (fp != stdout) {
+            fclose(fp);
+            remove(name);
+        }
+        return rc;
+    }
+    fprintf(fp, "ms");
+    for (i = 0; i < ss->ss_col_cnt; i++) {
+        sc = &ss->ss_cols[i];
+        fprintf(fp, ",%s.%s", ss->ss_groups[sc->sc_group], sc->sc_name);
+    }
+    fprintf(fp, "\n");
+
+    memset(&state.stats, 0, sizeof(state.stats));
+    old_sig = NULL;
+    if (!state.threaded) {
+        stats_stop = 0;
+        old_sig = signal(SIGINT, stats_sig);
+    }
+    start_ms = time_get_ms();
+    next_ms = start_ms;
+    for (samples = 0; !stats_stop && (!count || samples < count);
+         samples++) {
+        now = time_get_ms();
+        if ((int32_t)(now - next_ms) > interval) {
+            /* fell behind, don't send a burst to catch up */
+            next_ms = now;
+        }
+        ms = next_ms - start_ms;
+        next_ms += interval;
+        rc = stats_sample(ss, next_ms);
+        if (rc < 0) {
+            break;
+        }
+        missing += rc;
+        rc = 0;
+
+        fprintf(fp, "%u", ms);
+        for (i = 0; i < ss->ss_col_cnt; i++) {
+            sc = &ss->ss_cols[i];
+            if (sc->sc_valid) {
+                fprintf(fp, ",%llu", (unsigned long long)sc->sc_val);
+            } else {
+                fprintf(fp, ",");
+            }
+        }
+        fprintf(fp, "\n");
+        fflush(fp);
+
+        now = time_get_ms();
+        if ((int32_t)(next_ms - now) > 0 && !stats_stop &&
+          (!count || samples + 1 < count)) {
+            time_sleep_ms(next_ms - now);
+        }
+    }
+    if (!state.threaded) {
+        signal(SIGINT, old_sig);
+    }
+
+    if (fp != stdout && fclose(fp) && rc == 0) {
+        fprintf(stderr, "%s: write %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        rc = -1;
+    }
+    ms = time_get_ms() - start_ms;
+    fprintf(stderr, "%d samples of %d counters in %u.%03us, "
+      "%d responses missing", samples, ss->ss_col_cnt, ms / 1000, ms % 1000,
+      missing);
+    if (state.stats.stale_acks) {
+        fprintf(stderr, ", %d late", state.stats.stale_acks);
+    }
+    fprintf(stderr, "\n");
+    return rc;
+}
+
+/*
+ * Link probe. Echo requests carrying as much data as an upload segment of
+ * each chunk size are sent one at a time, and then with several in flight,
+ * to measure round trip time, goodput and loss. On NLIP transports longer
+ * lines are tried first. Ends with chunk size and line length to use.
+ */
+#define PROBE_ROUNDS            32
+#define PROBE_WINDOW_MAX        8
+#define PROBE_GIVEUP            3       /* lost with nothing through */
+#define PROBE_CHUNK_CNT         6
+
+static const int probe_chunks[PROBE_CHUNK_CNT] = {
+    64, 128, 256, 512, 1024, 2048
+};
+
+struct probe_result {
+    int pr_sent;
+    int pr_lost;
+    uint32_t pr_rtt[PROBE_ROUNDS];
+    int pr_rtt_cnt;
+    uint32_t pr_goodput;                /* echoed bytes/s */
+};
+
+static int
+probe_rtt_cmp(const void *a, const void *b)
+{
+    uint32_t ra = *(const uint32_t *)a;
+    uint32_t rb = *(const uint32_t *)b;
+
+    return ra < rb ? -1 : ra > rb;
+}
+
+/*
+ * Finds the longest line device takes, by tuning with each length in turn.
+ */
+static int
+probe_lines(void)
+{
+    static const int lens[] = { NLIP_LINE_MAX, 512, 256 };
+    int rc;
+    int i;
+
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        state.linelen = lens[i];
+        state.line_raw = NLIP_LINE_RAW(state.linelen);
+        rc = state.xport->t_tune();
+        if (rc < 0) {
+            return rc;
+        }
+        if (state.linelen == lens[i]) {
+            break;
+        }
+    }
+    fprintf(stdout, "Device takes %d byte lines\n", state.linelen);
+    return 0;
+}
+
+/*
+ * Request and payload buffers are TXBUF_SZ bytes.
+ */
+static int
+probe_run(int chunk, int window, struct probe_result *pr, uint8_t *buf,
+          char *payload)
+{
+    uint32_t sent_ms[PROBE_WINDOW_MAX];
+    uint8_t seqs[PROBE_WINDOW_MAX];
+    int pending[PROBE_WINDOW_MAX];
+    uint32_t start_ms;
+    uint32_t end_ms;
+    uint32_t ms;
+    uint8_t *rsp;
+    size_t len;
+    size_t cnt;
+    int outstanding;
+    int plen;
+    int seq;
+    int rc;
+    int n;
+    int i;
+
+    /* same amount of data as upload segment, see img_upload() */
+    plen = chunk;
+    if (state.xport->t_b64) {
+        plen = plen * 3 / 4;
+    }
+    plen -= 16;
+    memset(payload, 'x', plen);
+    cnt = serial_uploader_echo(buf, TXBUF_SZ, payload, plen);
+    if (cnt < 0 || cnt > TXBUF_SZ) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return -1;
+    }
+
+    memset(pr, 0, sizeof(*pr));
+    start_ms = time_get_ms();
+    while (pr->pr_sent < PROBE_ROUNDS) {
+        n = PROBE_ROUNDS - pr->pr_sent;
+        if (n > window) {
+            n = window;
+        }
+        for (i = 0; i < n; i++) {
+            serial_uploader_seq_set(buf, ++nmgr_seq);
+            seqs[i] = nmgr_seq;
+            pending[i] = 1;
+            sent_ms[i] = time_get_ms();
+            rc = xport_write(buf, cnt);
+            if (rc < 0) {
+                fprintf(stderr, "write fail %d\n", rc);
+                return rc;
+            }
+            pr->pr_sent++;
+        }
+        outstanding = n;
+        end_ms = time_get_ms() + RTO_MAX_MS;
+        while (outstanding) {
+            rc = state.xport->t_rx(&rsp, end_ms);
+            if (rc == -14) {
+                break;
+            } else if (rc < 0) {
+                fprintf(stderr, "read fail %d\n", rc);
+                return rc;
+            }
+            ms = time_get_ms();
+            seq = serial_uploader_rsp_seq(rsp, rc);
+            for (i = 0; i < n; i++) {
+                if (pending[i] && seqs[i] == seq) {
+                    break;
+                }
+            }
+            if (i == n) {
+                continue;
+            }
+            pending[i] = 0;
+            outstanding--;
+            if (serial_uploader_decode_echo(rsp, rc, &len) == 0 &&
+              len == plen) {
+                pr->pr_rtt[pr->pr_rtt_cnt++] = ms - sent_ms[i];
+            } else {
+                pr->pr_lost++;
+            }
+        }
+        pr->pr_lost += outstanding;
+        if (pr->pr_rtt_cnt == 0 && pr->pr_lost >= PROBE_GIVEUP) {
+            break;
+        }
+    }
+    ms = time_get_ms() - start_ms;
+    if (ms == 0) {
+        ms = 1;
+    }
+    pr->pr_goodput = (uint64_t)plen * pr->pr_rtt_cnt * 1000 / ms;
+    qsort(pr->pr_rtt, pr->pr_rtt_cnt, sizeof(pr->pr_rtt[0]), probe_rtt_cmp);
+    return 0;
+}
+
+static uint32_t
+probe_pct(struct probe_result *pr, int pct)
+{
+    return pr->pr_rtt[(pr->pr_rtt_cnt - 1) * pct / 100];
+}
+
+static int
+probe(int window_max)
+{
+    uint32_t goodput[PROBE_CHUNK_CNT][PROBE_WINDOW_MAX + 1];
+    int lost[PROBE_CHUNK_CNT][PROBE_WINDOW_MAX + 1];
+    struct probe_result pr;
+    uint8_t *buf;
+    char *payload;
+    size_t mark;
+    int best = -1;
+    int window;
+    int rc;
+    int c;
+    int w;
+
+    memset(goodput, 0, sizeof(goodput));
+    memset(lost, 0, sizeof(lost));
+    mark = arena_mark();
+    buf = arena_alloc(TXBUF_SZ);
+    payload = arena_alloc(TXBUF_SZ);
+    if (!buf || !payload) {
+        rc = -1;
+        goto out;
+    }
+    if (state.xport->t_tune) {
+        rc = probe_lines();
+        if (rc) {
+            goto out;
+        }
+    }
+    rc = 0;
+    fprintf(stdout, "%6s %6s %5s %5s %7s %7s %7s %10s\n", "chunk", "window",
+      "sent", "lost", "p50 ms", "p90 ms", "p99 ms", "B/s");
+    for (c = 0; c < PROBE_CHUNK_CNT; c++) {
+        for (w = 1; w <= window_max; w *= 2) {
+            rc = probe_run(probe_chunks[c], w, &pr, buf, payload);
+            if (rc) {
+                goto out;
+            }
+            lost[c][w] = pr.pr_lost;
+            goodput[c][w] = pr.pr_goodput;
+            if (pr.pr_rtt_cnt) {
+                fprintf(stdout, "%6d %6d %5d %5d %7u %7u %7u %10u\n",
+                  probe_chunks[c], w, pr.pr_sent, pr.pr_lost,
+                  probe_pct(&pr, 50), probe_pct(&pr, 90),
+                  probe_pct(&pr, 99), pr.pr_goodput);
+            } else {
+                fprintf(stdout, "%6d %6d %5d %5d %7s %7s %7s %10u\n",
+                  probe_chunks[c], w, pr.pr_sent, pr.pr_lost, "-", "-", "-",
+                  0);
+                break;
+            }
+        }
+        if (goodput[c][1] == 0) {
+            /* device does not take packets this big */
+            break;
+        }
+        if (lost[c][1] == 0 && (best < 0 || goodput[c][1] > goodput[best][1])) {
+            best = c;
+        }
+    }
+
+    if (best < 0) {
+        fprintf(stdout, "No chunk size got through without loss\n");
+        goto out;
+    }
+    window = 1;
+    for (w = 2; w <= window_max; w *= 2) {
+        if (lost[best][w] == 0 && goodput[best][w] > goodput[best][window]) {
+            window = w;
         }
     }
-
+    fprintf(stdout, "Recommended: -c %d", probe_chunks[best]);
+    if (state.xport->t_tune) {
+        fprintf(stdout, " -l %d", state.linelen);
+    }
+    fprintf(stdout, "\n");
+    if (window > 1) {
+        fprintf(stdout, "Device keeps up with %d requests in flight\n", window);
+    }
+out:
+    arena_release(mark);
     return rc;
 }
 
-static void
-flush_dev_console(void)
-{
-    port_write_data(state.port, "\n", 1);
-}
+/*
+ * Batch of operations done within one session. Manifest file has one per
+ * line:
+ *   upload <file> [<image number>]
+ *   config <name> <value>
+ *   coredump <file>
+ *   fsupload <file> <file on device>
+ *   fsdownload <file on device> <file>
+ *   fssync <directory> <directory on device>
+ *   logs <file> [<cursor file>]
+ *   stats <file> <group>[,<group>...] <interval ms> [<samples>]
+ *   probe [<max requests in flight>]
+ *   reset
+ * Empty lines and lines starting with '#' are skipped.
+ */
+#define BATCH_OPS_MAX           32
 
-static int
-echo_ctl(int val)
+enum batch_op_type {
+    BATCH_UPLOAD,
+    BATCH_CONFIG,
+    BATCH_COREDUMP,
+    BATCH_FS_UPLOAD,
+    BATCH_FS_DOWNLOAD,
+    BATCH_FS_SYNC,
+    BATCH_LOGS,
+    BATCH_STATS,
+    BATCH_PROBE,
+    BATCH_RESET
+};
+
+struct batch_op {
+    enum batch_op_type bo_type;
+    int bo_line;
+    char *bo_arg;                       /* file, or config name */
+    char *bo_val;                       /* config value, file on device */
+    int bo_image;
+    int bo_interval;                    /* stats sampling, in ms */
+    int bo_count;                       /* samples, probe window */
+};
+
+static struct batch_op batch_ops[BATCH_OPS_MAX];
+static int batch_cnt;
+
+/*
+ * DEV_TAG in the name of a file written to is replaced with the device
+ * name, so that with -w each device gets files of its own.
+ */
+#define DEV_TAG                 "{dev}"
+#define OUT_NAME_MAX            1024
+
+static const char *
+out_name(const char *tmpl, char *buf, size_t sz)
 {
-    uint8_t buf[512];
-    size_t cnt;
-    int rc;
+    const char *tag;
+    const char *dev;
+    size_t len;
+    char *p;
 
-    cnt = serial_uploader_echo_ctl(buf, sizeof(buf), 0);
-    if (cnt < 0) {
-        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
-        return (int)cnt;
+    tag = tmpl ? strstr(tmpl, DEV_TAG) : NULL;
+    if (!tag) {
+        return tmpl;
     }
-    rc = port_write(state.port, buf, cnt);
-    if (rc < 0) {
-        fprintf(stderr, "write fail %d\n", rc);
-        return rc;
+    dev = strrchr(state.devname, '/');
+    dev = dev ? dev + 1 : state.devname;
+    len = tag - tmpl;
+    snprintf(buf, sz, "%.*s%s%s", (int)len, tmpl, dev,
+      tag + strlen(DEV_TAG));
+
+    /* e.g. udp:host:port */
+    for (p = buf + len; p < buf + len + strlen(dev) && *p; p++) {
+        if (*p == ':' || *p == '\\') {
+            *p = '_';
+        }
     }
-    rc = port_read(state.port, buf, sizeof(buf), 2);
-    if (rc < 0) {
-        fprintf(stderr, "read fail %d\n", rc);
-        return rc;
+    return buf;
+}
+
+/*
+ * Local file op writes to, NULL if none.
+ */
+static const char *
+batch_out_file(enum batch_op_type type, const char *arg)
+{
+    switch (type) {
+    case BATCH_COREDUMP:
+    case BATCH_FS_DOWNLOAD:
+    case BATCH_STATS:
+        return arg;
+    default:
+        return NULL;
     }
-    return 0;
 }
 
-static size_t
-img_upload_tx_prepare(uint8_t *txbuf, size_t off, int *lenp)
+static int
+batch_add(enum batch_op_type type, int line, char *arg, char *val, int image)
 {
-    size_t blen;
-    size_t cnt;
+    struct batch_op *bo;
+    const char *out;
 
-    if (off == 0) {
-        blen = 32;
-        cnt = serial_uploader_create_seg0(txbuf, TXBUF_SZ, state.file_sz,
-          &state.file[off], blen);
-    } else {
-        blen = state.file_sz - off;
-        if (blen > state.imgchunk) {
-            blen = state.imgchunk;
-        }
-        cnt = serial_uploader_create_segX(txbuf, TXBUF_SZ, off,
-          &state.file[off], blen);
+    if (batch_cnt >= BATCH_OPS_MAX) {
+        fprintf(stderr, "%s: more than %d operations\n", cmdname,
+          BATCH_OPS_MAX);
+        return -1;
     }
-    if (cnt < 0) {
-        fprintf(stderr, "%s: message encoding issue %zd\n",
-                cmdname, cnt);
-    } else {
-        if (state.verbose) {
-            fprintf(stdout, " %zu-%zu\n", off, off + blen);
-        }
+    out = batch_out_file(type, arg);
+    if (state.watch && out && strcmp(out, "-") && !strstr(out, DEV_TAG)) {
+        fprintf(stderr, "%s: every device would write to %s, add %s to "
+          "its name\n", cmdname, out, DEV_TAG);
+        return -1;
     }
-    *lenp = blen;
-    return cnt;
+    bo = &batch_ops[batch_cnt];
+    bo->bo_type = type;
+    bo->bo_line = line;
+    bo->bo_arg = arg ? arena_strdup(arg) : NULL;
+    bo->bo_val = val ? arena_strdup(val) : NULL;
+    if ((arg && !bo->bo_arg) || (val && !bo->bo_val)) {
+        return -1;
+    }
+    bo->bo_image = image;
+    batch_cnt++;
+    return 0;
 }
 
 static int
-img_upload(void)
+batch_read(const char *name)
 {
-    int blen;
-    int nblen;
-    uint8_t txbuf[TXBUF_SZ];
-    int txcnt;
-    uint8_t rxbuf[128];
-    int rxcnt;
-    int tmo;
-    int rc;
-    size_t off;
-    size_t next_off;
+    FILE *fp;
+    char buf[256];
+    char *cmd;
+    char *arg;
+    char *val;
+    char *eptr;
+    int line = 0;
+    int image;
+    int interval;
+    int count;
+    int rc = 0;
 
-    /*
-     * Data is base64 encoded. Leave 16 bytes for rest of the CBOR payload.
-     * CBOR has [ 'off':<number> 'data':<imgchunk> ]
-     */
-    state.imgchunk = ((state.imgchunk * 3 / 4) - 16);
-    if (state.verbose) {
-        fprintf(stdout, "Starting upload %zu bytes\n", state.file_sz);
+    fp = fopen(name, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
+          strerror(errno));
+        return -1;
     }
-
-    txcnt = img_upload_tx_prepare(txbuf, 0, &blen);
-    tmo = FIRST_SEG_TMO;
-    for (off = 0; off < state.file_sz;) {
-        rc = port_write(state.port, txbuf, txcnt);
-        if (rc < 0) {
-            fprintf(stderr, "write fail %d\n", rc);
-            return rc;
-        }
-        txcnt = img_upload_tx_prepare(txbuf, off + blen, &nblen);
-        rxcnt = port_read(state.port, rxbuf, sizeof(rxbuf), tmo);
-        if (rxcnt == -14) {
-            goto retransmit;
-        }
-        if (rxcnt < 0) {
-            fprintf(stderr, "read fail %d\n", rxcnt);
-            return rxcnt;
-        }
-        rc = serial_uploader_decode_rsp(rxbuf, rxcnt, &next_off);
-        if (rc < 0) {
-            fprintf(stderr, "%s: response decoding issue %d\n",
-              cmdname, rc);
-            return rc;
-        } else if (rc > 0) {
-            fprintf(stderr, "%s: newtmgr error response %d\n",
-              cmdname, rc);
-            return -5;
-        }
-	if (state.verbose) {
-            fprintf(stdout, "ack to %zu\n", next_off);
-	} else {
-            fprintf(stdout, ".");
-            fflush(stdout);
-        }
-        if (next_off == state.file_sz) {
-            break;
-        }
-        if (next_off > state.file_sz) {
-            fprintf(stderr, "%s: offset %zu larger than file %zu\n",
-              cmdname, next_off, state.file_sz);
-            return -1;
+    while (rc == 0 && fgets(buf, sizeof(buf), fp)) {
+        line++;
+        cmd = strtok(buf, " \t\r\n");
+        if (!cmd || cmd[0] == '#') {
+            continue;
         }
-        tmo = NEXT_SEG_TMO;
-        if (off + blen != next_off) {
-retransmit:
-            txcnt = img_upload_tx_prepare(txbuf, off, &blen);
-            if (off == 0) {
-                tmo = FIRST_SEG_TMO;
+        arg = strtok(NULL, " \t\r\n");
+        val = strtok(NULL, " \t\r\n");
+        if (!strcmp(cmd, "upload") && arg) {
+            image = 0;
+            if (val) {
+                image = strtoul(val, &eptr, 0);
+                if (*eptr != '\0') {
+                    goto err;
+                }
+            }
+            rc = batch_add(BATCH_UPLOAD, line, arg, NULL, image);
+        } else if (!strcmp(cmd, "config") && arg && val) {
+            rc = batch_add(BATCH_CONFIG, line, arg, val, 0);
+        } else if (!strcmp(cmd, "coredump") && arg && !val) {
+            rc = batch_add(BATCH_COREDUMP, line, arg, NULL, 0);
+        } else if (!strcmp(cmd, "fsupload") && arg && val) {
+            rc = batch_add(BATCH_FS_UPLOAD, line, arg, val, 0);
+        } else if (!strcmp(cmd, "fsdownload") && arg && val) {
+            rc = batch_add(BATCH_FS_DOWNLOAD, line, val, arg, 0);
+        } else if (!strcmp(cmd, "fssync") && arg && val) {
+            rc = batch_add(BATCH_FS_SYNC, line, arg, val, 0);
+        } else if (!strcmp(cmd, "logs") && arg) {
+            rc = batch_add(BATCH_LOGS, line, arg, val, 0);
+        } else if (!strcmp(cmd, "stats") && arg && val) {
+            interval = 0;
+            count = 0;
+            cmd = strtok(NULL, " \t\r\n");
+            if (cmd) {
+                interval = strtoul(cmd, &eptr, 0);
+                if (*eptr != '\0') {
+                    goto err;
+                }
+                cmd = strtok(NULL, " \t\r\n");
+            }
+            if (cmd) {
+                count = strtoul(cmd, &eptr, 0);
+                if (*eptr != '\0') {
+                    goto err;
+                }
+            }
+            if (interval <= 0) {
+                goto err;
+            }
+            rc = batch_add(BATCH_STATS, line, arg, val, 0);
+            if (rc == 0) {
+                batch_ops[batch_cnt - 1].bo_interval = interval;
+                batch_ops[batch_cnt - 1].bo_count = count;
+            }
+        } else if (!strcmp(cmd, "probe") && !val) {
+            count = 4;
+            if (arg) {
+                count = strtoul(arg, &eptr, 0);
+                if (*eptr != '\0' || count < 1 || count > PROBE_WINDOW_MAX) {
+                    goto err;
+                }
+            }
+            rc = batch_add(BATCH_PROBE, line, NULL, NULL, 0);
+            if (rc == 0) {
+                batch_ops[batch_cnt - 1].bo_count = count;
             }
+        } else if (!strcmp(cmd, "reset") && !arg) {
+            rc = batch_add(BATCH_RESET, line, NULL, NULL, 0);
         } else {
-            off = next_off;
-            blen = nblen;
+err:
+            fprintf(stderr, "%s: %s line %d: invalid operation\n",
+              cmdname, name, line);
+            rc = -1;
         }
     }
-    if (state.verbose) {
-        fprintf(stdout, "Upload complete\n");
-    } else {
-        fprintf(stdout, "\n");
-    }
-    return 0;
+    fclose(fp);
+    return rc;
 }
 
 static int
-reset_device(void)
+config_write(const char *name, const char *val)
 {
     uint8_t buf[512];
+    uint8_t *rsp;
     size_t cnt;
+    size_t off;
     int rc;
 
-    cnt = serial_uploader_reset(buf, sizeof(buf), 0);
-    if (cnt < 0) {
+    cnt = serial_uploader_config_write(buf, sizeof(buf), name, val);
+    if (cnt < 0 || cnt > sizeof(buf)) {
         fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
-        return (int)cnt;
+        return -1;
     }
-    rc = port_write(state.port, buf, cnt);
+    rc = xport_write(buf, cnt);
     if (rc < 0) {
         fprintf(stderr, "write fail %d\n", rc);
         return rc;
     }
-    rc = port_read(state.port, buf, sizeof(buf), 2);
+    rc = xport_read(&rsp, 2);
     if (rc < 0) {
         fprintf(stderr, "read fail %d\n", rc);
         return rc;
     }
+    rc = serial_uploader_decode_rsp(rsp, rc, &off);
+    if (rc < 0) {
+        fprintf(stderr, "%s: response decoding issue %d\n", cmdname, rc);
+        return rc;
+    } else if (rc > 0) {
+        fprintf(stderr, "%s: newtmgr error response %d\n", cmdname, rc);
+        return -5;
+    }
     if (state.verbose) {
-        fprintf(stdout, "Device reset\n");
+        fprintf(stdout, "Config %s set to %s\n", name, val);
     }
     return 0;
 }
 
+static int
+batch_run(void)
+{
+    struct batch_op *bo;
+    char out_buf[OUT_NAME_MAX];
+    const char *out;
+    int rc = 0;
+    int i;
+
+    for (i = 0; i < batch_cnt && rc == 0; i++) {
+        bo = &batch_ops[i];
+        out = out_name(bo->bo_arg, out_buf, sizeof(out_buf));
+        switch (bo->bo_type) {
+        case BATCH_UPLOAD:
+            state.filename = bo->bo_arg;
+            state.image = bo->bo_image;
+            rc = img_upload_file(state.filename);
+            break;
+        case BATCH_CONFIG:
+            rc = config_write(bo->bo_arg, bo->bo_val);
+            break;
+        case BATCH_COREDUMP:
+            rc = core_download(out);
+            break;
+        case BATCH_FS_UPLOAD:
+            if (state.manifest) {
+                fprintf(stdout, "Uploading %s to %s\n", bo->bo_arg,
+                  bo->bo_val);
+            }
+            rc = fs_upload(bo->bo_arg, bo->bo_val);
+            break;
+        case BATCH_FS_DOWNLOAD:
+            fprintf(stdout, "Downloading %s to %s\n", bo->bo_val, out);
+            rc = dl_run(bo->bo_val, out, NULL);
+            if (rc == 1) {
+                fprintf(stderr, "%s: %s not on device\n", cmdname,
+                  bo->bo_val);
+                rc = -1;
+            }
+            break;
+        case BATCH_FS_SYNC:
+            rc = fs_sync(bo->bo_arg, bo->bo_val);
+            break;
+        case BATCH_LOGS:
+            rc = logs_read(out, bo->bo_val);
+            break;
+        case BATCH_STATS:
+            rc = stats_run(out, bo->bo_val, bo->bo_interval,
+              bo->bo_count);
+            break;
+        case BATCH_PROBE:
+            rc = probe(bo->bo_count);
+            break;
+        case BATCH_RESET:
+            rc = reset_device();
+            break;
+        }
+        if (rc && state.manifest) {
+            fprintf(stderr, "%s: %s line %d failed\n", cmdname,
+              state.manifest, bo->bo_line);
+        }
+    }
+    return rc;
+}
+
 static void
 usage(void)
 {
     fprintf(stderr, "Usage:\n%s <options>\n", cmdname);
     fprintf(stderr, "  Options:\n");
-    fprintf(stderr, "   -f <filename>      - image file to upload\n");
-    fprintf(stderr, "   -d <serialdevname> - serial console for device\n");
+    fprintf(stderr, "   -f <filename>      - image file to upload, and/or\n");
+    fprintf(stderr, "   -D <filename>      - file to download core dump to, and/or\n");
+    fprintf(stderr, "   -L <file> [<cursor>] - file to append device logs to, and\n");
+    fprintf(stderr, "                        cursor file to continue from, kept per\n");
+    fprintf(stderr, "                        port, not per board, and/or\n");
+    fprintf(stderr, "   -S <file> <group>[,<group>...] <interval ms> [<samples>]\n");
+    fprintf(stderr, "                      - sample stats to new CSV file, until\n");
+    fprintf(stderr, "                        interrupted if no sample count, and/or\n");
+    fprintf(stderr, "   -P [<window>]      - probe chunk size, line length and requests\n");
+    fprintf(stderr, "                        in flight, up to window (default: 4), or\n");
+    fprintf(stderr, "   -m <manifest>      - file with operations to do, one per line:\n");
+    fprintf(stderr, "                        upload <file> [<image number>]\n");
+    fprintf(stderr, "                        config <name> <value>\n");
+    fprintf(stderr, "                        coredump <file>\n");
+    fprintf(stderr, "                        fsupload <file> <file on device>\n");
+    fprintf(stderr, "                        fsdownload <file on device> <file>\n");
+    fprintf(stderr, "                        fssync <directory> <directory on device>\n");
+    fprintf(stderr, "                        logs <file> [<cursor file>]\n");
+    fprintf(stderr, "                        stats <file> <group>[,<group>...] <interval ms> [<samples>]\n");
+    fprintf(stderr, "                        probe [<max requests in flight>]\n");
+    fprintf(stderr, "                        reset\n");
+    fprintf(stderr, "   -d <serialdevname> - serial console for device, or\n");
+    fprintf(stderr, "      udp:<host>[:<port>] - device with newtmgr over UDP\n");
+    fprintf(stderr, "      tcp:<host>:<port> - serial device server, raw TCP\n");
+    fprintf(stderr, "      rfc2217:<host>:<port> - serial device server, telnet, or\n");
+    fprintf(stderr, "   -w <pattern>       - watch for serial ports, e.g. '/dev/ttyUSB*',\n");
+    fprintf(stderr, "                        and run on each one as it appears; files\n");
+    fprintf(stderr, "                        written to need {dev} in their name, which\n");
+    fprintf(stderr, "                        is replaced with the port name\n");
     fprintf(stderr, "  [-c <chunk>]        - Max image chunk size (default: 512)\n");
     fprintf(stderr, "  [-s <speed>]        - serial port speed (default: 115200)\n");
+    fprintf(stderr, "  [-F]                - RTS/CTS flow control on serial port\n");
+    fprintf(stderr, "  [-I <engine>]       - serial port I/O with poll (default) or uring\n");
+    fprintf(stderr, "  [-l <linelen>]      - Max NLIP line length, probed if over 128\n");
+    fprintf(stderr, "                        (default: 128)\n");
+    fprintf(stderr, "  [-e]                - erase slot before sending first segment\n");
+    fprintf(stderr, "  [-C <file>]         - save device console output, '-' for stdout\n");
+    fprintf(stderr, "  [-n]                - upload image file as is, without checking\n");
+    fprintf(stderr, "                        it or whether device has it already\n");
+    fprintf(stderr, "  [-V]                - verify image hash before reset\n");
     fprintf(stderr, "  [-v]                - verbose output\n");
     exit(1);
 }
@@ -427,18 +2903,111 @@ parse_opts(int argc, char **argv)
         case 'v':
             state.verbose++;
             break;
+        case 'V':
+            state.verify = 1;
+            break;
+        case 'e':
+            state.erase = 1;
+            break;
+        case 'n':
+            state.no_check = 1;
+            break;
+        case 'F':
+            state.flowctl = 1;
+            break;
+        case 'I':
+            if (argc < 1) {
+                usage();
+            }
+            arg = parse_opts_optarg(&argc, &argv);
+            if (!strcmp(arg, "uring")) {
+                state.uring = 1;
+            } else if (strcmp(arg, "poll")) {
+                fprintf(stderr, "%s: Invalid I/O engine %s\n", cmdname, arg);
+                usage();
+            }
+            break;
         case 'd':
             if (argc < 1) {
                 usage();
             }
             state.devname = parse_opts_optarg(&argc, &argv);
             break;
+        case 'w':
+            if (argc < 1) {
+                usage();
+            }
+            state.watch = parse_opts_optarg(&argc, &argv);
+            break;
         case 'f':
             if (argc < 1) {
                 usage();
             }
             state.filename = parse_opts_optarg(&argc, &argv);
             break;
+        case 'm':
+            if (argc < 1) {
+                usage();
+            }
+            state.manifest = parse_opts_optarg(&argc, &argv);
+            break;
+        case 'D':
+            if (argc < 1) {
+                usage();
+            }
+            state.coredump = parse_opts_optarg(&argc, &argv);
+            break;
+        case 'L':
+            if (argc < 1) {
+                usage();
+            }
+            state.logs = parse_opts_optarg(&argc, &argv);
+            if (argc > 0 && argv[0][0] != '-') {
+                state.log_cursor = parse_opts_optarg(&argc, &argv);
+            }
+            break;
+        case 'S':
+            if (argc < 3) {
+                usage();
+            }
+            state.stats_file = parse_opts_optarg(&argc, &argv);
+            state.stats_groups = parse_opts_optarg(&argc, &argv);
+            arg = parse_opts_optarg(&argc, &argv);
+            state.stats_interval = strtoul(arg, &eptr, 0);
+            if (*eptr != '\0' || state.stats_interval <= 0) {
+                fprintf(stderr, "%s: Invalid stats interval %s\n",
+                  cmdname, arg);
+                usage();
+            }
+            if (argc > 0 && argv[0][0] != '-') {
+                arg = parse_opts_optarg(&argc, &argv);
+                state.stats_count = strtoul(arg, &eptr, 0);
+                if (*eptr != '\0') {
+                    fprintf(stderr, "%s: Invalid stats sample count %s\n",
+                      cmdname, arg);
+                    usage();
+                }
+            }
+            break;
+        case 'P':
+            state.probe = 4;
+            if (argc > 0 && argv[0][0] != '-') {
+                arg = parse_opts_optarg(&argc, &argv);
+                state.probe = strtoul(arg, &eptr, 0);
+                if (*eptr != '\0' || state.probe < 1 ||
+                  state.probe > PROBE_WINDOW_MAX) {
+                    fprintf(stderr, "%s: Invalid probe window %s\n",
+                      cmdname, arg);
+                    usage();
+                }
+            }
+            break;
+        case 'C':
+            if (argc < 1) {
+                usage();
+            }
+            state.console = parse_opts_optarg(&argc, &argv);
+            break;
         case 'c':
             if (argc < 1) {
                 usage();
@@ -451,6 +3020,18 @@ parse_opts(int argc, char **argv)
                 usage();
             }
             break;
+        case 'l':
+            if (argc < 1) {
+                usage();
+            }
+            arg = parse_opts_optarg(&argc, &argv);
+            state.linelen = strtoul(arg, &eptr, 0);
+            if (*eptr != '\0') {
+                fprintf(stderr, "%s: Invalid line length %s\n",
+                  cmdname, arg);
+                usage();
+            }
+            break;
         case 's':
             if (argc < 1) {
                 usage();
@@ -474,12 +3055,21 @@ parse_opts(int argc, char **argv)
 static void
 validate_opts(void)
 {
-    if (state.imgchunk < 64 || state.imgchunk > 2048) {
+    if (state.imgchunk < 64 || state.imgchunk > IMGCHUNK_MAX) {
         fprintf(stderr, "%s: Invalid image chunk size %d\n",
           cmdname, state.imgchunk);
-        fprintf(stderr, "  has to be between 64 and 2048 bytes\n");
+        fprintf(stderr, "  has to be between 64 and %d bytes\n",
+          IMGCHUNK_MAX);
+        usage();
+    }
+    if (state.linelen < 32 || state.linelen > NLIP_LINE_MAX) {
+        fprintf(stderr, "%s: Invalid line length %d\n",
+          cmdname, state.linelen);
+        fprintf(stderr, "  has to be between 32 and %d bytes\n",
+          NLIP_LINE_MAX);
         usage();
     }
+    state.line_raw = NLIP_LINE_RAW(state.linelen);
     switch (state.speed) {
     case 115200:
     case 230400:
@@ -491,62 +3081,117 @@ validate_opts(void)
           cmdname, state.speed);
         usage();
     }
-    if (state.filename == NULL) {
-        fprintf(stderr, "%s: Need file to upload\n", cmdname);
+    if ((state.filename == NULL && state.coredump == NULL &&
+        state.logs == NULL && state.stats_file == NULL &&
+        state.probe == 0) == (state.manifest == NULL)) {
+        fprintf(stderr, "%s: Need either operations to do, or manifest\n",
+          cmdname);
         usage();
     }
-    if (state.devname == NULL) {
-        fprintf(stderr, "%s: Need serial device to use\n", cmdname);
+    if ((state.devname == NULL) == (state.watch == NULL)) {
+        fprintf(stderr, "%s: Need either serial device to use or pattern "
+          "to watch for\n", cmdname);
         usage();
     }
 }
 
+/*
+ * Runs operations against one device.
+ */
+static int
+session_run(const char *devname)
+{
+    int rc;
+
+    state.devname = devname;
+    if (state.watch) {
+        console_dev = devname;
+    }
+    rc = xport_open(devname);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = echo_ctl(0);
+    if (rc == 0 && state.xport->t_tune) {
+        rc = state.xport->t_tune();
+    }
+    if (rc == 0) {
+        rc = batch_run();
+    }
+#if 0
+    if (echo_ctl(1)) {
+        return 1;
+    }
+#endif
+    if (state.xport->t_close) {
+        state.xport->t_close();
+    }
+    fflush(stderr);
+    fflush(stdout);
+    return rc;
+}
+
 int
 main(int argc, char **argv)
 {
-    HANDLE fd;
     int rc;
 
     cmdname = argv[0];
     state.imgchunk = 512;
     state.speed = 115200;
+    state.linelen = SHELL_NLIP_MAX_FRAME;
 
     parse_opts(argc, argv);
     validate_opts();
 
-    fd = port_open(state.devname);
-    if (fd < 0) {
-        exit(1);
+    if (state.manifest) {
+        rc = batch_read(state.manifest);
+    } else {
+        rc = 0;
+        if (state.probe) {
+            rc = batch_add(BATCH_PROBE, 0, NULL, NULL, 0);
+            if (rc == 0) {
+                batch_ops[batch_cnt - 1].bo_count = state.probe;
+            }
+        }
+        if (state.coredump) {
+            rc |= batch_add(BATCH_COREDUMP, 0, (char *)state.coredump, NULL,
+              0);
+        }
+        if (state.logs) {
+            rc |= batch_add(BATCH_LOGS, 0, (char *)state.logs,
+              (char *)state.log_cursor, 0);
+        }
+        if (state.stats_file) {
+            rc |= batch_add(BATCH_STATS, 0, (char *)state.stats_file,
+              (char *)state.stats_groups, 0);
+            if (rc == 0) {
+                batch_ops[batch_cnt - 1].bo_interval = state.stats_interval;
+                batch_ops[batch_cnt - 1].bo_count = state.stats_count;
+            }
+        }
+        if (state.filename) {
+            rc |= batch_add(BATCH_UPLOAD, 0, (char *)state.filename, NULL, 0);
+            rc |= batch_add(BATCH_RESET, 0, NULL, NULL, 0);
+        }
     }
-    state.port = fd;
-
-    rc = port_setup(state.port, state.speed);
     if (rc < 0) {
         exit(1);
     }
-
-    rc = file_read(state.filename, &state.file_sz, &state.file);
-    if (rc < 0) {
+    if (state.console && console_open(state.console) < 0) {
         exit(1);
     }
 
-    flush_dev_console();
-
-    rc = echo_ctl(0);
-    if (rc == 0) {
-        rc = img_upload();
-    }
-    if (rc == 0) {
-        rc = reset_device();
+    if (state.watch) {
+        rc = port_watch(state.watch, session_run);
+    } else {
+        rc = session_run(state.devname);
     }
-#if 0
-    if (echo_ctl(1)) {
-        return 1;
+    if (state.verbose) {
+        fprintf(stdout, "Arena peak %zu of %d bytes\n", arena_peak(),
+          ARENA_SZ);
     }
-#endif
-    free(state.file);
-    fflush(stderr);
-    fflush(stdout);
     if (rc) {
         exit(1);
     }
@@ -22,25 +22,296 @@
 
 #ifndef WIN32
 typedef int HANDLE;
+#else
+#define strtok_r strtok_s
 #endif
 
+/*
+ * Per session. With -w -I uring sessions are threads of one process,
+ * sharing one io_uring; see serial_upload_uring.c.
+ */
+#ifdef _MSC_VER
+#define SESSION_LOCAL __declspec(thread)
+#else
+#define SESSION_LOCAL __thread
+#endif
+
+/*
+ * Packet passed to framing as a list of fragments, so that image data
+ * can be sent from where it sits in memory.
+ */
+struct pkt_iov {
+    const uint8_t *pi_base;
+    size_t pi_len;
+};
+
+/*
+ * Image upload segment with the fixed part encoded once. Only the offset
+ * and the data length are written per segment.
+ */
+#define SEGX_HDR_MAX    48
+#define SEGX_IOV_CNT    3
+
+struct segx_tmpl {
+    uint8_t st_hdr[SEGX_HDR_MAX];
+    size_t st_fixed;            /* nmgr_hdr, "_h" and "off" key */
+};
+
+/*
+ * Lines longer than SHELL_NLIP_MAX_FRAME work only with devices built with
+ * larger shell buffers. Each line carries 2 byte marker, base64 data and
+ * newline.
+ */
+#define SHELL_NLIP_MAX_FRAME    128
+#define NLIP_LINE_MAX           1024
+#define NLIP_LINE_RAW(linelen)  ((((linelen) - 3) / 4) * 3)
+
+/*
+ * Transport carries newtmgr packets (nmgr_hdr + CBOR) to the device and
+ * back. t_rx() returns length of the response, which stays valid until the
+ * next call, or -14 if end_ms passes.
+ */
+struct transport {
+    const char *t_name;
+    int t_b64;                  /* data is base64 encoded on the wire */
+    int (*t_open)(const char *addr);
+    int (*t_tune)(void);        /* optional, once device responds */
+    int (*t_tx)(struct pkt_iov *iov, int iovcnt);
+    int (*t_rx)(uint8_t **bufp, uint32_t end_ms);
+    void (*t_close)(void);      /* optional */
+};
+
+extern const struct transport serial_transport;
+extern const struct transport udp_transport;
+extern const struct transport tcp_transport;
+extern const struct transport rfc2217_transport;
+
+/*
+ * Byte stream carrying NLIP framed packets; serial port, or TCP connection
+ * to a serial device server.
+ */
+struct nlip_io {
+    int (*ni_write)(void *buf, size_t len);
+    int (*ni_read)(char *buf, size_t maxlen, uint32_t end_ms);
+    int (*ni_drain)(void);              /* optional */
+};
+
+/*
+ * Device console output, lines on the byte stream which are not NLIP.
+ * Called with pieces of lines as they come in; bol is set for the first
+ * piece of a line.
+ */
+typedef void (*nlip_console_fn)(const char *data, size_t len, int bol);
+
+void nlip_attach(const struct nlip_io *io);
+void nlip_console_attach(nlip_console_fn fn);
+int nlip_xport_tune(void);
+int nlip_xport_tx(struct pkt_iov *iov, int iovcnt);
+int nlip_xport_rx(uint8_t **bufp, uint32_t end_ms);
+
+/*
+ * Image slot as reported by the device.
+ */
+#define IMG_HASH_LEN            32
+#define IMG_SLOT_MAX            4
+
+#define IMG_STATE_F_BOOTABLE    0x01
+#define IMG_STATE_F_PENDING     0x02
+#define IMG_STATE_F_CONFIRMED   0x04
+#define IMG_STATE_F_ACTIVE      0x08
+#define IMG_STATE_F_PERMANENT   0x10
+
+struct image_slot_state {
+    int is_slot;
+    char is_version[32];
+    uint8_t is_hash[IMG_HASH_LEN];
+    int is_hash_len;
+    uint8_t is_flags;                   /* IMG_STATE_F_XXX */
+};
+
+/*
+ * MCUboot image in a file, as checked by img_validate(). Hash points to
+ * the SHA256 TLV within the file contents.
+ */
+struct img_info {
+    uint32_t ii_hdr_size;
+    uint32_t ii_prot_tlv_size;
+    uint32_t ii_img_size;
+    uint32_t ii_flags;
+    char ii_version[24];
+    size_t ii_hashed_len;               /* header, image, protected TLVs */
+    size_t ii_tlv_end;
+    const uint8_t *ii_hash;
+};
+
+/*
+ * Chunk of data read from the device, core dump or file. Data is copied
+ * to dc_data, up to dc_len bytes. Total length is sent only with the first
+ * chunk. File hash response decodes to the same, with the hash as data
+ * and file length as total.
+ */
+struct dl_chunk {
+    size_t dc_off;
+    size_t dc_total;
+    int dc_total_valid;
+    uint8_t *dc_data;
+    size_t dc_len;
+};
+
+/*
+ * Entry from device log. Message can't be longer than the packet it came
+ * in.
+ */
+#define LOG_NAME_MAX            32
+#define LOG_MSG_MAX             2048
+
+struct log_entry {
+    char le_log[LOG_NAME_MAX];
+    int64_t le_ts;
+    uint32_t le_index;
+    int le_level;
+    int le_module;
+    int le_binary;                      /* message is not text */
+    size_t le_msg_len;
+    uint8_t le_msg[LOG_MSG_MAX];
+};
+
+/*
+ * Longest stats group or counter name.
+ */
+#define STATS_NAME_MAX          32
+
+struct upload_stats {
+    uint32_t start_ms;
+    size_t tx_bytes;            /* written to port, framing included */
+    int tx_stalls;              /* waits for port to take more data */
+    int tx_lines;
+    int tx_pkts;
+    int retransmits;
+    int stale_acks;             /* acks to earlier transmissions, dropped */
+    uint32_t erase_ms;          /* explicit erase, before first segment */
+};
+
+struct upload_state {
+    const char *devname;
+    const char *watch;          /* port name pattern, -w */
+    int speed;
+    int flowctl;                /* RTS/CTS */
+    int uring;                  /* use io_uring for serial port I/O */
+    int threaded;               /* session is a thread, not a process */
+    HANDLE port;
+    const struct transport *xport;
+    const char *filename;
+    const char *fs_name;        /* file upload, name on device */
+    const char *manifest;
+    const char *console;        /* file for device console output */
+    const char *coredump;       /* file to download core dump to */
+    const char *logs;           /* file to append device logs to */
+    const char *log_cursor;     /* where reading logs continues from */
+    const char *stats_file;     /* file to write stats samples to */
+    const char *stats_groups;
+    int stats_interval;         /* in ms */
+    int stats_count;            /* samples, 0 until interrupted */
+    int probe;                  /* max requests in flight to probe */
+    size_t file_sz;
+    uint8_t *file;
+    int image;                  /* image number for multi-image devices */
+    int imgchunk;
+    int segsz;                  /* image bytes per upload segment */
+    int linelen;
+    int line_raw;
+    int verbose;
+    int verify;
+    int no_check;               /* upload file as is, -n */
+    int erase;                  /* erase slot before upload starts */
+    const uint8_t *img_hash;    /* SHA256 TLV within file */
+    struct upload_stats stats;
+};
+
+extern SESSION_LOCAL struct upload_state state;
+
 size_t serial_uploader_echo_ctl(uint8_t *buf, size_t sz, int val);
+size_t serial_uploader_echo(uint8_t *buf, size_t sz, const char *str, int len);
 size_t serial_uploader_reset(uint8_t *buf, size_t sz, int val);
+int serial_uploader_decode_echo(uint8_t *buf, size_t sz, size_t *len);
 size_t serial_uploader_create_seg0(uint8_t *buf, size_t sz,
-    size_t file_sz, uint8_t *data, int seglen);
+    size_t file_sz, uint8_t *data, int seglen, int image);
 size_t serial_uploader_create_segX(uint8_t *buf, size_t sz,
     size_t off, uint8_t *data, int seglen);
+int serial_uploader_segX_tmpl_init(struct segx_tmpl *st);
+int serial_uploader_fs_tmpl_init(struct segx_tmpl *st);
+size_t serial_uploader_fs_seg0(uint8_t *buf, size_t sz, const char *name,
+    size_t file_sz, uint8_t *data, int seglen);
+size_t serial_uploader_segX_tmpl_fill(struct segx_tmpl *st, size_t off,
+    uint8_t *data, int seglen, struct pkt_iov *iov);
 int serial_uploader_decode_rsp(uint8_t *buf, size_t sz, size_t *off);
 int serial_uploader_is_rsp(uint8_t *buf, size_t sz);
+void serial_uploader_seq_set(uint8_t *buf, uint8_t seq);
+int serial_uploader_rsp_seq(uint8_t *buf, size_t sz);
+size_t serial_uploader_config_write(uint8_t *buf, size_t sz, const char *name,
+    const char *val);
+size_t serial_uploader_image_state(uint8_t *buf, size_t sz);
+size_t serial_uploader_image_erase(uint8_t *buf, size_t sz);
+size_t serial_uploader_image_erase_state(uint8_t *buf, size_t sz);
+int serial_uploader_decode_image_state(uint8_t *buf, size_t sz,
+    struct image_slot_state *slots, int *cnt);
+size_t serial_uploader_core_list(uint8_t *buf, size_t sz);
+size_t serial_uploader_core_load(uint8_t *buf, size_t sz, size_t off);
+size_t serial_uploader_fs_download(uint8_t *buf, size_t sz, const char *name,
+    size_t off);
+size_t serial_uploader_fs_hash(uint8_t *buf, size_t sz, const char *name);
+int serial_uploader_decode_chunk(uint8_t *buf, size_t sz,
+    struct dl_chunk *dc);
+size_t serial_uploader_stats_read(uint8_t *buf, size_t sz, const char *name);
+int serial_uploader_decode_stats(uint8_t *buf, size_t sz,
+    void (*fn)(const char *name, uint64_t val, void *arg), void *arg);
+size_t serial_uploader_log_list(uint8_t *buf, size_t sz);
+size_t serial_uploader_log_read(uint8_t *buf, size_t sz, const char *name,
+    uint32_t index);
+int serial_uploader_decode_log_list(uint8_t *buf, size_t sz,
+    char (*names)[LOG_NAME_MAX], int *cnt);
+int serial_uploader_decode_logs(uint8_t *buf, size_t sz, uint32_t *next_index,
+    int (*fn)(struct log_entry *le, void *arg), void *arg);
+
+int img_validate(const char *name, const uint8_t *buf, size_t len,
+    struct img_info *ii);
+
+/*
+ * Working buffers, from one fixed size arena; see serial_upload_arena.c.
+ */
+#ifndef ARENA_SZ
+#define ARENA_SZ                (64 * 1024)
+#endif
+
+void *arena_alloc(size_t sz);
+char *arena_strdup(const char *str);
+size_t arena_mark(void);
+void arena_release(size_t mark);
+size_t arena_peak(void);
 
 HANDLE port_open(const char *name);
-int port_setup(HANDLE fd, unsigned long speed);
+int port_setup(HANDLE fd, unsigned long speed, int flowctl);
 int port_write_data(HANDLE fd, void *buf, size_t len);
-int port_read_poll(HANDLE fd, char *buf, size_t maxlen, int end_time,
+int port_drain(HANDLE fd);
+void port_close(HANDLE fd);
+void port_restore_sig(int sig);
+int port_watch(const char *pattern, int (*session)(const char *devname));
+int uring_port_init(int fd);
+void uring_port_close(void);
+int uring_port_write(const void *buf, size_t len);
+int uring_port_drain(void);
+int uring_port_read(char *buf, size_t maxlen, uint32_t end_ms);
+int port_read_poll(HANDLE fd, char *buf, size_t maxlen, uint32_t end_ms,
                    int verbose);
-int file_read(const char *name, size_t *sz, uint8_t **bufp);
+int file_map(const char *name, size_t *sz, uint8_t **bufp);
+void file_unmap(uint8_t *buf, size_t sz);
+int dir_list(const char *dir, int (*fn)(const char *name, void *arg),
+    void *arg);
 int time_get(void);
+uint32_t time_get_ms(void);
+void time_sleep_ms(uint32_t ms);
 
+void stats_interrupt(void);
 void dump_hex(const char *hdr, void *bufv, int cnt);
 
 extern const char *cmdname;
@@ -0,0 +1,107 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+/*
+ * Working buffers which don't fit comfortably on the stack, or whose
+ * number depends on input, come from one arena of ARENA_SZ bytes. It is
+ * a stack: operation takes a mark when it starts, and releases to it when
+ * done. Manifest contents are taken first, and stay for the whole run.
+ * Session threads (-w -I uring) each have an arena of their own; manifest
+ * contents stay in the one of the main thread.
+ *
+ * Peak use is manifest strings, plus the largest operation:
+ *   manifest, BATCH_OPS_MAX lines of up to 256 bytes     8 KiB
+ *   fssync, SYNC_FILES_MAX names of up to 256 bytes     32 KiB
+ *     + file read buffer                                 4 KiB
+ *   image upload, two segments of 2 x TXBUF_SZ           9 KiB
+ *   probe, request and payload of TXBUF_SZ               4 KiB
+ * Rest of memory use is fixed size too: transport buffers are static
+ * (serial port tx queue or io_uring buffers 16-20 KiB, NLIP receive
+ * 3 KiB), and stack stays under 40 KiB, path name buffers of port setup
+ * and watch mode being most of it. Image file is mapped, not read; its
+ * pages are page cache, which kernel can drop as upload moves on. stdio
+ * buffers for manifest, console and output files come from libc.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "serial_upload.h"
+
+#define ARENA_ALIGN             16
+
+static SESSION_LOCAL union {
+    uint8_t a_mem[ARENA_SZ];
+    uint64_t a_align;
+    void *a_ptr;
+} arena;
+static SESSION_LOCAL size_t arena_off;
+static SESSION_LOCAL size_t arena_max;
+
+void *
+arena_alloc(size_t sz)
+{
+    void *p;
+
+    sz = (sz + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (sz > ARENA_SZ - arena_off) {
+        fprintf(stderr, "%s: out of memory, %zu bytes wanted, %zu free\n",
+          cmdname, sz, ARENA_SZ - arena_off);
+        return NULL;
+    }
+    p = &arena.a_mem[arena_off];
+    arena_off += sz;
+    if (arena_off > arena_max) {
+        arena_max = arena_off;
+    }
+    return p;
+}
+
+char *
+arena_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *p;
+
+    p = arena_alloc(len);
+    if (p) {
+        memcpy(p, str, len);
+    }
+    return p;
+}
+
+size_t
+arena_mark(void)
+{
+    return arena_off;
+}
+
+void
+arena_release(size_t mark)
+{
+    arena_off = mark;
+}
+
+size_t
+arena_peak(void)
+{
+    return arena_max;
+}
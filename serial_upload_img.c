@@ -0,0 +1,169 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+/*
+ * MCUboot image checks before upload. Image has a header, image body, and
+ * TLV areas; protected TLVs, which are covered by the image hash, and the
+ * rest. Everything is checked in place, within the file contents.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "serial_upload.h"
+#include "sha256/sha256.h"
+
+#define IMAGE_MAGIC                 0x96f3b83d
+#define IMAGE_HEADER_SIZE           32
+
+#define IMAGE_TLV_INFO_MAGIC        0x6907
+#define IMAGE_TLV_PROT_INFO_MAGIC   0x6908
+#define IMAGE_TLV_INFO_SIZE         4
+#define IMAGE_TLV_SHA256            0x10
+
+#define IMAGE_F_ENCRYPTED_AES128    0x04
+#define IMAGE_F_ENCRYPTED_AES256    0x08
+
+static uint16_t
+get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Checks TLV area at off, which has to be size bytes long, and picks up
+ * the image hash from it.
+ */
+static int
+img_tlv_walk(const char *name, const uint8_t *buf, size_t len, uint64_t off,
+             uint16_t magic, uint64_t size, struct img_info *ii)
+{
+    uint64_t end;
+    uint16_t tlen;
+
+    if (off + IMAGE_TLV_INFO_SIZE > len ||
+      get_le16(&buf[off]) != magic) {
+        fprintf(stderr, "%s: %s: no TLV area at %" PRIu64 "\n", cmdname,
+          name, off);
+        return -1;
+    }
+    end = off + get_le16(&buf[off + 2]);
+    if ((size && end - off != size) || end - off < IMAGE_TLV_INFO_SIZE ||
+      end > len) {
+        fprintf(stderr, "%s: %s: TLV area at %" PRIu64 " is %" PRIu64
+          " bytes, truncated or inconsistent\n", cmdname, name, off,
+          end - off);
+        return -1;
+    }
+    off += IMAGE_TLV_INFO_SIZE;
+    while (off < end) {
+        if (off + 4 > end ||
+          off + 4 + (tlen = get_le16(&buf[off + 2])) > end) {
+            fprintf(stderr, "%s: %s: TLV at %" PRIu64 " runs past TLV area\n",
+              cmdname, name, off);
+            return -1;
+        }
+        if (buf[off] == IMAGE_TLV_SHA256) {
+            if (tlen != IMG_HASH_LEN) {
+                fprintf(stderr, "%s: %s: SHA256 TLV is %u bytes\n", cmdname,
+                  name, tlen);
+                return -1;
+            }
+            ii->ii_hash = &buf[off + 4];
+        }
+        off += 4 + tlen;
+    }
+    ii->ii_tlv_end = end;
+    return 0;
+}
+
+/*
+ * Checks that file is a complete MCUboot image, and that its contents
+ * match the hash in it. Hash of an encrypted image is over the plain
+ * text, and can't be checked here.
+ */
+int
+img_validate(const char *name, const uint8_t *buf, size_t len,
+             struct img_info *ii)
+{
+    struct sha256_ctx ctx;
+    uint8_t hash[IMG_HASH_LEN];
+    uint64_t off;
+
+    memset(ii, 0, sizeof(*ii));
+    if (len < IMAGE_HEADER_SIZE || get_le32(buf) != IMAGE_MAGIC) {
+        fprintf(stderr, "%s: %s is not an MCUboot image\n", cmdname, name);
+        return -1;
+    }
+    ii->ii_hdr_size = get_le16(&buf[8]);
+    ii->ii_prot_tlv_size = get_le16(&buf[10]);
+    ii->ii_img_size = get_le32(&buf[12]);
+    ii->ii_flags = get_le32(&buf[16]);
+    snprintf(ii->ii_version, sizeof(ii->ii_version), "%u.%u.%u.%" PRIu32,
+      buf[20], buf[21], get_le16(&buf[22]), get_le32(&buf[24]));
+
+    if (ii->ii_hdr_size < IMAGE_HEADER_SIZE) {
+        fprintf(stderr, "%s: %s: header size %" PRIu32 " too small\n",
+          cmdname, name, ii->ii_hdr_size);
+        return -1;
+    }
+    off = (uint64_t)ii->ii_hdr_size + ii->ii_img_size;
+    if (off > len) {
+        fprintf(stderr, "%s: %s is truncated, %zu bytes of %" PRIu64 "\n",
+          cmdname, name, len, off);
+        return -1;
+    }
+    if (ii->ii_prot_tlv_size) {
+        if (img_tlv_walk(name, buf, len, off, IMAGE_TLV_PROT_INFO_MAGIC,
+            ii->ii_prot_tlv_size, ii)) {
+            return -1;
+        }
+        ii->ii_hash = NULL;
+        off += ii->ii_prot_tlv_size;
+    }
+    ii->ii_hashed_len = off;
+    if (img_tlv_walk(name, buf, len, off, IMAGE_TLV_INFO_MAGIC, 0, ii)) {
+        return -1;
+    }
+    if (!ii->ii_hash) {
+        fprintf(stderr, "%s: %s: no SHA256 TLV\n", cmdname, name);
+        return -1;
+    }
+
+    if (ii->ii_flags & (IMAGE_F_ENCRYPTED_AES128 | IMAGE_F_ENCRYPTED_AES256)) {
+        return 0;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, ii->ii_hashed_len);
+    sha256_final(&ctx, hash);
+    if (memcmp(hash, ii->ii_hash, IMG_HASH_LEN)) {
+        fprintf(stderr, "%s: %s: image contents don't match its hash\n",
+          cmdname, name);
+        return -1;
+    }
+    return 0;
+}
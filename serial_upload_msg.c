@@ -73,6 +73,14 @@ struct nmgr_hdr {
 #define IMGMGR_NMGR_ID_ERASE        5
 #define IMGMGR_NMGR_ID_ERASE_STATE  6
 
+#define FS_NMGR_ID_FILE             0
+#define FS_NMGR_ID_HASH             2
+
+#define STATS_NMGR_ID_READ          0
+
+#define LOGS_NMGR_ID_READ           0
+#define LOGS_NMGR_ID_LOGS_LIST      5
+
 size_t
 serial_uploader_echo_ctl(uint8_t *buf, size_t sz, int val)
 {
@@ -108,6 +116,41 @@ serial_uploader_echo_ctl(uint8_t *buf, size_t sz, int val)
 	return len + sizeof(*nh);
 }
 
+size_t
+serial_uploader_echo(uint8_t *buf, size_t sz, const char *str, int len)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int elen;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_WRITE);
+	nh->nh_group = htons(MGMT_GROUP_ID_DEFAULT);
+	nh->nh_id = NMGR_ID_ECHO;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "_h");
+	rc |= cbor_encode_byte_string(&map, (void *)&nh, sizeof(nh));
+
+	rc |= cbor_encode_text_stringz(&map, "d");
+	rc |= cbor_encode_text_string(&map, str, len);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	elen = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(elen);
+
+	return elen + sizeof(*nh);
+}
+
 size_t
 serial_uploader_reset(uint8_t *buf, size_t sz, int val)
 {
@@ -142,7 +185,7 @@ serial_uploader_reset(uint8_t *buf, size_t sz, int val)
 
 size_t
 serial_uploader_create_seg0(uint8_t *buf, size_t sz,
-    size_t file_sz, uint8_t *data, int seglen)
+    size_t file_sz, uint8_t *data, int seglen, int image)
 {
 	int rc;
 	int len;
@@ -163,6 +206,10 @@ serial_uploader_create_seg0(uint8_t *buf, size_t sz,
 	rc |= cbor_encode_text_stringz(&map, "_h");
 	rc |= cbor_encode_byte_string(&map, (void *)&nh, sizeof(nh));
 
+	if (image) {
+		rc |= cbor_encode_text_stringz(&map, "image");
+		rc |= cbor_encode_uint(&map, image);
+	}
 	rc |= cbor_encode_text_stringz(&map, "sha");
 	rc |= cbor_encode_byte_string(&map, NULL, 0);
 	rc |= cbor_encode_text_stringz(&map, "off");
@@ -181,6 +228,47 @@ serial_uploader_create_seg0(uint8_t *buf, size_t sz,
 	return len + sizeof(*nh);
 }
 
+/*
+ * First segment of file upload; has the name of the file on device.
+ */
+size_t
+serial_uploader_fs_seg0(uint8_t *buf, size_t sz, const char *name,
+    size_t file_sz, uint8_t *data, int seglen)
+{
+	int rc;
+	int len;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_WRITE);
+	nh->nh_group = htons(MGMT_GROUP_ID_FS);
+	nh->nh_id = FS_NMGR_ID_FILE;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "name");
+	rc |= cbor_encode_text_stringz(&map, name);
+	rc |= cbor_encode_text_stringz(&map, "off");
+	rc |= cbor_encode_uint(&map, 0);
+	rc |= cbor_encode_text_stringz(&map, "len");
+	rc |= cbor_encode_uint(&map, file_sz);
+	rc |= cbor_encode_text_stringz(&map, "data");
+	rc |= cbor_encode_byte_string(&map, data, seglen);
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
 size_t
 serial_uploader_create_segX(uint8_t *buf, size_t sz,
     size_t off, uint8_t *data, int seglen)
@@ -219,6 +307,132 @@ serial_uploader_create_segX(uint8_t *buf, size_t sz,
 	return len + sizeof(*nh);
 }
 
+#define CBOR_MAJOR_UINT         (0 << 5)
+#define CBOR_MAJOR_BYTES        (2 << 5)
+
+static const uint8_t segx_data_key[] = { 0x64, 'd', 'a', 't', 'a' };
+static const uint8_t segx_break = 0xff;
+
+/*
+ * Writes CBOR initial byte + argument, returns number of bytes used.
+ */
+static int
+cbor_put_head(uint8_t *p, uint8_t major, uint64_t val)
+{
+	int cnt;
+	int i;
+
+	if (val < 24) {
+		p[0] = major | val;
+		return 1;
+	} else if (val <= 0xff) {
+		p[0] = major | 24;
+		cnt = 1;
+	} else if (val <= 0xffff) {
+		p[0] = major | 25;
+		cnt = 2;
+	} else if (val <= 0xffffffff) {
+		p[0] = major | 26;
+		cnt = 4;
+	} else {
+		p[0] = major | 27;
+		cnt = 8;
+	}
+	for (i = cnt; i > 0; i--) {
+		p[i] = val & 0xff;
+		val >>= 8;
+	}
+	return cnt + 1;
+}
+
+/*
+ * Encodes the part of segX which stays the same for the whole upload;
+ * same bytes as serial_uploader_create_segX() up to and including the
+ * "off" key.
+ */
+static int
+segx_tmpl_init(struct segx_tmpl *st, int group, int id)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+
+	nh = (struct nmgr_hdr *)st->st_hdr;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_WRITE);
+	nh->nh_group = htons(group);
+	nh->nh_id = id;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1),
+	    sizeof(st->st_hdr) - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map,  CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "_h");
+	rc |= cbor_encode_byte_string(&map, (void *)&nh, sizeof(nh));
+
+	rc |= cbor_encode_text_stringz(&map, "off");
+	if (rc) {
+		return -1;
+	}
+	st->st_fixed = sizeof(*nh) +
+	  cbor_encoder_get_buffer_size(&map, (void *)(nh + 1));
+
+	/* offset, "data" key and byte string header must still fit */
+	if (st->st_fixed + 9 + sizeof(segx_data_key) + 5 > sizeof(st->st_hdr)) {
+		return -1;
+	}
+	return 0;
+}
+
+int
+serial_uploader_segX_tmpl_init(struct segx_tmpl *st)
+{
+	return segx_tmpl_init(st, MGMT_GROUP_ID_IMAGE, IMGMGR_NMGR_ID_UPLOAD);
+}
+
+/*
+ * Same for file upload. Device knows the file from the first segment.
+ */
+int
+serial_uploader_fs_tmpl_init(struct segx_tmpl *st)
+{
+	return segx_tmpl_init(st, MGMT_GROUP_ID_FS, FS_NMGR_ID_FILE);
+}
+
+/*
+ * Fills in offset and data length, and returns the segment as header,
+ * data and map terminator in iov[SEGX_IOV_CNT]. Data is not copied.
+ */
+size_t
+serial_uploader_segX_tmpl_fill(struct segx_tmpl *st, size_t off,
+    uint8_t *data, int seglen, struct pkt_iov *iov)
+{
+	struct nmgr_hdr *nh;
+	uint8_t *p;
+	size_t len;
+
+	p = st->st_hdr + st->st_fixed;
+	p += cbor_put_head(p, CBOR_MAJOR_UINT, off);
+	memcpy(p, segx_data_key, sizeof(segx_data_key));
+	p += sizeof(segx_data_key);
+	p += cbor_put_head(p, CBOR_MAJOR_BYTES, seglen);
+
+	iov[0].pi_base = st->st_hdr;
+	iov[0].pi_len = p - st->st_hdr;
+	iov[1].pi_base = data;
+	iov[1].pi_len = seglen;
+	iov[2].pi_base = &segx_break;
+	iov[2].pi_len = sizeof(segx_break);
+
+	len = iov[0].pi_len + iov[1].pi_len + iov[2].pi_len;
+	nh = (struct nmgr_hdr *)st->st_hdr;
+	nh->nh_len = htons(len - sizeof(*nh));
+
+	return len;
+}
+
 int
 serial_uploader_is_rsp(uint8_t *buf, size_t sz)
 {
@@ -235,6 +449,46 @@ serial_uploader_is_rsp(uint8_t *buf, size_t sz)
 	return 0;
 }
 
+void
+serial_uploader_seq_set(uint8_t *buf, uint8_t seq)
+{
+	((struct nmgr_hdr *)buf)->nh_seq = seq;
+}
+
+/*
+ * Returns sequence number echoed back in response, -1 if this is not
+ * a response.
+ */
+int
+serial_uploader_rsp_seq(uint8_t *buf, size_t sz)
+{
+	if (!serial_uploader_is_rsp(buf, sz)) {
+		return -1;
+	}
+	return ((struct nmgr_hdr *)buf)->nh_seq;
+}
+
+/*
+ * Reads map key to name, and moves val to the value. Keys which don't fit
+ * are returned as empty strings.
+ */
+static int
+cbor_read_key(CborValue *val, char *name, size_t sz)
+{
+	size_t nlen = sz;
+
+	if (cbor_value_get_type(val) != CborTextStringType) {
+		return -1;
+	}
+	if (cbor_value_copy_text_string(val, name, &nlen, val)) {
+		name[0] = '\0';
+		if (cbor_value_advance(val)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int
 serial_uploader_decode_rsp(uint8_t *buf, size_t sz, size_t *off)
 {
@@ -243,10 +497,9 @@ serial_uploader_decode_rsp(uint8_t *buf, size_t sz, size_t *off)
 	CborValue val;
 	int rc;
 	int64_t val64;
-	int64_t rsp_rc;
+	int64_t rsp_rc = 0;
 	int64_t rsp_off = 0;
-	char *name;
-	size_t nlen;
+	char name[8];
 
 	buf += sizeof(struct nmgr_hdr);
 	sz -= sizeof(struct nmgr_hdr);
@@ -265,9 +518,7 @@ serial_uploader_decode_rsp(uint8_t *buf, size_t sz, size_t *off)
 		if (cbor_value_get_type(&val) != CborTextStringType) {
 			break;
 		}
-		nlen = 0;
-		rc = cbor_value_dup_text_string(&val, &name, &nlen, &val);
-		if (rc) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
 			return -5;
 		}
 		if (cbor_value_get_type(&val) != CborIntegerType) {
@@ -285,3 +536,841 @@ serial_uploader_decode_rsp(uint8_t *buf, size_t sz, size_t *off)
 
 	return rsp_rc;
 }
+
+#define CONF_NMGR_OP            0
+
+size_t
+serial_uploader_config_write(uint8_t *buf, size_t sz, const char *name,
+    const char *val)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_WRITE);
+	nh->nh_group = htons(MGMT_GROUP_ID_CONFIG);
+	nh->nh_id = CONF_NMGR_OP;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "_h");
+	rc |= cbor_encode_byte_string(&map, (void *)&nh, sizeof(nh));
+
+	rc |= cbor_encode_text_stringz(&map, "name");
+	rc |= cbor_encode_text_stringz(&map, name);
+	rc |= cbor_encode_text_stringz(&map, "val");
+	rc |= cbor_encode_text_stringz(&map, val);
+	rc |= cbor_encode_text_stringz(&map, "save");
+	rc |= cbor_encode_boolean(&map, true);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+/*
+ * Request without arguments.
+ */
+static size_t
+serial_uploader_req(uint8_t *buf, size_t sz, int op, int group, int id)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, op);
+	nh->nh_group = htons(group);
+	nh->nh_id = id;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "_h");
+	rc |= cbor_encode_byte_string(&map, (void *)&nh, sizeof(nh));
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+size_t
+serial_uploader_image_state(uint8_t *buf, size_t sz)
+{
+	return serial_uploader_req(buf, sz, NMGR_OP_READ,
+	    MGMT_GROUP_ID_IMAGE, IMGMGR_NMGR_ID_STATE);
+}
+
+size_t
+serial_uploader_image_erase(uint8_t *buf, size_t sz)
+{
+	return serial_uploader_req(buf, sz, NMGR_OP_WRITE,
+	    MGMT_GROUP_ID_IMAGE, IMGMGR_NMGR_ID_ERASE);
+}
+
+size_t
+serial_uploader_image_erase_state(uint8_t *buf, size_t sz)
+{
+	return serial_uploader_req(buf, sz, NMGR_OP_WRITE,
+	    MGMT_GROUP_ID_IMAGE, IMGMGR_NMGR_ID_ERASE_STATE);
+}
+
+size_t
+serial_uploader_core_list(uint8_t *buf, size_t sz)
+{
+	return serial_uploader_req(buf, sz, NMGR_OP_READ,
+	    MGMT_GROUP_ID_IMAGE, IMGMGR_NMGR_ID_CORELIST);
+}
+
+size_t
+serial_uploader_core_load(uint8_t *buf, size_t sz, size_t off)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_READ);
+	nh->nh_group = htons(MGMT_GROUP_ID_IMAGE);
+	nh->nh_id = IMGMGR_NMGR_ID_CORELOAD;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "off");
+	rc |= cbor_encode_uint(&map, off);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+size_t
+serial_uploader_fs_download(uint8_t *buf, size_t sz, const char *name,
+    size_t off)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_READ);
+	nh->nh_group = htons(MGMT_GROUP_ID_FS);
+	nh->nh_id = FS_NMGR_ID_FILE;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "name");
+	rc |= cbor_encode_text_stringz(&map, name);
+	rc |= cbor_encode_text_stringz(&map, "off");
+	rc |= cbor_encode_uint(&map, off);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+/*
+ * SHA-256 of a file on device. Not all devices implement this.
+ */
+size_t
+serial_uploader_fs_hash(uint8_t *buf, size_t sz, const char *name)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_READ);
+	nh->nh_group = htons(MGMT_GROUP_ID_FS);
+	nh->nh_id = FS_NMGR_ID_HASH;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "name");
+	rc |= cbor_encode_text_stringz(&map, name);
+	rc |= cbor_encode_text_stringz(&map, "type");
+	rc |= cbor_encode_text_stringz(&map, "sha256");
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+size_t
+serial_uploader_stats_read(uint8_t *buf, size_t sz, const char *name)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_READ);
+	nh->nh_group = htons(MGMT_GROUP_ID_STATS);
+	nh->nh_id = STATS_NMGR_ID_READ;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "name");
+	rc |= cbor_encode_text_stringz(&map, name);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+/*
+ * Entries of log name with index >= index.
+ */
+size_t
+serial_uploader_log_read(uint8_t *buf, size_t sz, const char *name,
+    uint32_t index)
+{
+	int rc;
+	CborEncoder enc;
+	CborEncoder map;
+	struct nmgr_hdr *nh;
+	int len;
+
+	nh = (struct nmgr_hdr *)buf;
+	memset(nh, 0, sizeof(*nh));
+	NMGR_OP_SET(nh, NMGR_OP_READ);
+	nh->nh_group = htons(MGMT_GROUP_ID_LOGS);
+	nh->nh_id = LOGS_NMGR_ID_READ;
+
+	cbor_encoder_init(&enc, (void *)(nh + 1), sz - sizeof(*nh), 0);
+
+	rc = cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+
+	rc |= cbor_encode_text_stringz(&map, "log_name");
+	rc |= cbor_encode_text_stringz(&map, name);
+	rc |= cbor_encode_text_stringz(&map, "ts");
+	rc |= cbor_encode_int(&map, 0);
+	rc |= cbor_encode_text_stringz(&map, "index");
+	rc |= cbor_encode_uint(&map, index);
+
+	rc |= cbor_encoder_close_container(&enc, &map);
+	if (rc) {
+		return -1;
+	}
+	len = cbor_encoder_get_buffer_size(&enc, (void *)(nh + 1));
+	nh->nh_len = htons(len);
+
+	return len + sizeof(*nh);
+}
+
+size_t
+serial_uploader_log_list(uint8_t *buf, size_t sz)
+{
+	return serial_uploader_req(buf, sz, NMGR_OP_READ, MGMT_GROUP_ID_LOGS,
+	    LOGS_NMGR_ID_LOGS_LIST);
+}
+
+static int
+serial_uploader_decode_slot(CborValue *map_val, struct image_slot_state *is)
+{
+	CborValue val;
+	char name[16];
+	int64_t val64;
+	size_t len;
+	bool flag;
+	int i;
+	static const char *flag_names[] = {
+		"bootable", "pending", "confirmed", "active", "permanent"
+	};
+
+	memset(is, 0, sizeof(*is));
+	if (cbor_value_enter_container(map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "slot") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &val64);
+			is->is_slot = val64;
+		} else if (!strcmp(name, "version") &&
+		    cbor_value_is_text_string(&val)) {
+			len = sizeof(is->is_version);
+			if (cbor_value_copy_text_string(&val, is->is_version,
+			    &len, NULL)) {
+				return -6;
+			}
+		} else if (!strcmp(name, "hash") &&
+		    cbor_value_is_byte_string(&val)) {
+			len = sizeof(is->is_hash);
+			if (cbor_value_copy_byte_string(&val, is->is_hash,
+			    &len, NULL)) {
+				return -6;
+			}
+			is->is_hash_len = len;
+		} else if (cbor_value_is_boolean(&val)) {
+			cbor_value_get_boolean(&val, &flag);
+			for (i = 0; i < 5; i++) {
+				if (flag && !strcmp(name, flag_names[i])) {
+					is->is_flags |= 1 << i;
+				}
+			}
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+	if (cbor_value_leave_container(map_val, &val)) {
+		return -3;
+	}
+	return 0;
+}
+
+/*
+ * Decodes image state response, up to *cnt slots. Returns newtmgr rc,
+ * or < 0 if response can't be decoded.
+ */
+int
+serial_uploader_decode_image_state(uint8_t *buf, size_t sz,
+    struct image_slot_state *slots, int *cnt)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	CborValue arr;
+	char name[16];
+	int64_t rsp_rc = 0;
+	int max = *cnt;
+	int rc;
+
+	*cnt = 0;
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "images") &&
+		    cbor_value_is_array(&val)) {
+			if (cbor_value_enter_container(&val, &arr)) {
+				return -3;
+			}
+			while (!cbor_value_at_end(&arr)) {
+				if (*cnt < max && cbor_value_is_map(&arr)) {
+					rc = serial_uploader_decode_slot(&arr,
+					    &slots[*cnt]);
+					if (rc) {
+						return rc;
+					}
+					(*cnt)++;
+				} else if (cbor_value_advance(&arr)) {
+					return -6;
+				}
+			}
+			if (cbor_value_leave_container(&val, &arr)) {
+				return -3;
+			}
+			continue;
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
+
+/*
+ * Decodes response carrying a chunk of data; core dump, file download, or
+ * file hash. Returns newtmgr rc, or < 0 if response can't be decoded.
+ */
+int
+serial_uploader_decode_chunk(uint8_t *buf, size_t sz, struct dl_chunk *dc)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	char name[16];
+	uint64_t val64;
+	int64_t rsp_rc = 0;
+	size_t max = dc->dc_len;
+	int rc;
+
+	dc->dc_len = 0;
+	dc->dc_total_valid = 0;
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "off") &&
+		    cbor_value_is_unsigned_integer(&val)) {
+			cbor_value_get_uint64(&val, &val64);
+			dc->dc_off = val64;
+		} else if (!strcmp(name, "len") &&
+		    cbor_value_is_unsigned_integer(&val)) {
+			cbor_value_get_uint64(&val, &val64);
+			dc->dc_total = val64;
+			dc->dc_total_valid = 1;
+		} else if ((!strcmp(name, "data") ||
+		    !strcmp(name, "output")) &&
+		    cbor_value_is_byte_string(&val)) {
+			dc->dc_len = max;
+			if (cbor_value_copy_byte_string(&val, dc->dc_data,
+			    &dc->dc_len, NULL)) {
+				return -6;
+			}
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
+
+static int
+serial_uploader_decode_log_entry(CborValue *map_val, struct log_entry *le)
+{
+	CborValue val;
+	char name[16];
+	int64_t val64;
+
+	le->le_ts = 0;
+	le->le_index = 0;
+	le->le_level = 0;
+	le->le_module = 0;
+	le->le_binary = 0;
+	le->le_msg_len = 0;
+	if (cbor_value_enter_container(map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &val64);
+			if (!strcmp(name, "ts")) {
+				le->le_ts = val64;
+			} else if (!strcmp(name, "index")) {
+				le->le_index = val64;
+			} else if (!strcmp(name, "level")) {
+				le->le_level = val64;
+			} else if (!strcmp(name, "module")) {
+				le->le_module = val64;
+			}
+		} else if (!strcmp(name, "msg") &&
+		    cbor_value_is_text_string(&val)) {
+			le->le_msg_len = sizeof(le->le_msg);
+			if (cbor_value_copy_text_string(&val,
+			    (char *)le->le_msg, &le->le_msg_len, NULL)) {
+				return -6;
+			}
+		} else if (!strcmp(name, "msg") &&
+		    cbor_value_is_byte_string(&val)) {
+			le->le_binary = 1;
+			le->le_msg_len = sizeof(le->le_msg);
+			if (cbor_value_copy_byte_string(&val, le->le_msg,
+			    &le->le_msg_len, NULL)) {
+				return -6;
+			}
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+	if (cbor_value_leave_container(map_val, &val)) {
+		return -3;
+	}
+	return 0;
+}
+
+static int
+serial_uploader_decode_log(CborValue *map_val, struct log_entry *le,
+    int (*fn)(struct log_entry *le, void *arg), void *arg)
+{
+	CborValue val;
+	CborValue arr;
+	char name[16];
+	size_t len;
+	int rc;
+
+	le->le_log[0] = '\0';
+	if (cbor_value_enter_container(map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "name") && cbor_value_is_text_string(&val)) {
+			len = sizeof(le->le_log);
+			if (cbor_value_copy_text_string(&val, le->le_log, &len,
+			    NULL)) {
+				le->le_log[0] = '\0';
+			}
+		} else if (!strcmp(name, "entries") &&
+		    cbor_value_is_array(&val)) {
+			if (cbor_value_enter_container(&val, &arr)) {
+				return -3;
+			}
+			while (!cbor_value_at_end(&arr)) {
+				if (!cbor_value_is_map(&arr)) {
+					return -2;
+				}
+				rc = serial_uploader_decode_log_entry(&arr, le);
+				if (rc) {
+					return rc;
+				}
+				rc = fn(le, arg);
+				if (rc) {
+					return rc;
+				}
+			}
+			if (cbor_value_leave_container(&val, &arr)) {
+				return -3;
+			}
+			continue;
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+	if (cbor_value_leave_container(map_val, &val)) {
+		return -3;
+	}
+	return 0;
+}
+
+/*
+ * Decodes log read response, calling fn for each entry. Returns newtmgr
+ * rc, or < 0 if response can't be decoded or fn fails.
+ */
+int
+serial_uploader_decode_logs(uint8_t *buf, size_t sz, uint32_t *next_index,
+    int (*fn)(struct log_entry *le, void *arg), void *arg)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	CborValue arr;
+	struct log_entry le;
+	char name[16];
+	int64_t rsp_rc = 0;
+	uint64_t val64;
+	int rc;
+
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "next_index") &&
+		    cbor_value_is_unsigned_integer(&val)) {
+			cbor_value_get_uint64(&val, &val64);
+			*next_index = val64;
+		} else if (!strcmp(name, "logs") && cbor_value_is_array(&val)) {
+			if (cbor_value_enter_container(&val, &arr)) {
+				return -3;
+			}
+			while (!cbor_value_at_end(&arr)) {
+				if (!cbor_value_is_map(&arr)) {
+					return -2;
+				}
+				rc = serial_uploader_decode_log(&arr, &le, fn,
+				    arg);
+				if (rc) {
+					return rc;
+				}
+			}
+			if (cbor_value_leave_container(&val, &arr)) {
+				return -3;
+			}
+			continue;
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
+
+/*
+ * Decodes log list response, up to *cnt names. Returns newtmgr rc, or < 0
+ * if response can't be decoded.
+ */
+int
+serial_uploader_decode_log_list(uint8_t *buf, size_t sz,
+    char (*names)[LOG_NAME_MAX], int *cnt)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	CborValue arr;
+	char name[16];
+	int64_t rsp_rc = 0;
+	int max = *cnt;
+	size_t len;
+	int rc;
+
+	*cnt = 0;
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "log_list") &&
+		    cbor_value_is_array(&val)) {
+			if (cbor_value_enter_container(&val, &arr)) {
+				return -3;
+			}
+			while (!cbor_value_at_end(&arr)) {
+				len = LOG_NAME_MAX;
+				if (*cnt < max && cbor_value_is_text_string(&arr) &&
+				    !cbor_value_copy_text_string(&arr,
+				    names[*cnt], &len, NULL)) {
+					(*cnt)++;
+				}
+				if (cbor_value_advance(&arr)) {
+					return -6;
+				}
+			}
+			if (cbor_value_leave_container(&val, &arr)) {
+				return -3;
+			}
+			continue;
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
+
+/*
+ * Decodes stats group read response, calling fn for each counter. Returns
+ * newtmgr rc, or < 0 if response can't be decoded.
+ */
+int
+serial_uploader_decode_stats(uint8_t *buf, size_t sz,
+    void (*fn)(const char *name, uint64_t val, void *arg), void *arg)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	CborValue fields;
+	char name[STATS_NAME_MAX];
+	int64_t rsp_rc = 0;
+	uint64_t val64;
+	int rc;
+
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "fields") && cbor_value_is_map(&val)) {
+			if (cbor_value_enter_container(&val, &fields)) {
+				return -3;
+			}
+			while (!cbor_value_at_end(&fields)) {
+				if (cbor_read_key(&fields, name, sizeof(name))) {
+					return -5;
+				}
+				if (cbor_value_is_unsigned_integer(&fields)) {
+					cbor_value_get_uint64(&fields, &val64);
+					if (name[0]) {
+						fn(name, val64, arg);
+					}
+				}
+				if (cbor_value_advance(&fields)) {
+					return -6;
+				}
+			}
+			if (cbor_value_leave_container(&val, &fields)) {
+				return -3;
+			}
+			continue;
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
+
+/*
+ * Decodes echo response, and returns length of the echoed string in len.
+ * Returns newtmgr rc, or < 0 if response can't be decoded.
+ */
+int
+serial_uploader_decode_echo(uint8_t *buf, size_t sz, size_t *len)
+{
+	CborParser parser;
+	CborValue map_val;
+	CborValue val;
+	char name[16];
+	int64_t rsp_rc = 0;
+	int rc;
+
+	*len = 0;
+	buf += sizeof(struct nmgr_hdr);
+	sz -= sizeof(struct nmgr_hdr);
+	rc = cbor_parser_init(buf, sz, 0, &parser, &map_val);
+	if (rc) {
+		return rc;
+	}
+
+	if (cbor_value_get_type(&map_val) != CborMapType) {
+		return -2;
+	}
+	if (cbor_value_enter_container(&map_val, &val)) {
+		return -3;
+	}
+	while (!cbor_value_at_end(&val)) {
+		if (cbor_read_key(&val, name, sizeof(name))) {
+			return -5;
+		}
+		if (!strcmp(name, "rc") && cbor_value_is_integer(&val)) {
+			cbor_value_get_int64(&val, &rsp_rc);
+		} else if (!strcmp(name, "r") && cbor_value_is_text_string(&val)) {
+			if (cbor_value_calculate_string_length(&val, len)) {
+				return -6;
+			}
+		}
+		if (cbor_value_advance(&val)) {
+			return -6;
+		}
+	}
+
+	return rsp_rc;
+}
@@ -0,0 +1,724 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Socket transports. UDP carries newtmgr packets as is, one per datagram.
+ * TCP connects to a serial device server (ser2net etc.) and carries the
+ * console byte stream with NLIP framing, optionally with RFC 2217 telnet
+ * COM port control for setting the baud rate.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#endif
+
+#include "serial_upload.h"
+
+#define UDP_DEFAULT_PORT        "1337"
+#define UDP_PKT_MAX             2048
+#define TCP_WRITE_TMO           5000    /* ms without progress */
+#define RFC2217_TMO             3000    /* ms for server to answer */
+
+#ifndef WIN32
+typedef int sock_t;
+#define INVALID_SOCKET          (-1)
+#define closesocket             close
+#define sock_errstr()           strerror(errno)
+#define sock_again()            (errno == EAGAIN || errno == EWOULDBLOCK)
+#else
+typedef SOCKET sock_t;
+#define sock_errstr()           "error"
+#define sock_again()            (WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+
+static SESSION_LOCAL struct {
+    sock_t sock;
+    uint8_t rxbuf[UDP_PKT_MAX];
+} udp;
+
+/*
+ * Address is <host>[:<port>], IPv6 addresses within brackets.
+ */
+static sock_t
+net_connect(const char *addr, const char *defport, int socktype)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    char host[128];
+    const char *port = defport;
+    sock_t sock;
+    char *p;
+    int rc;
+#ifdef WIN32
+    WSADATA wsa;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        fprintf(stderr, "%s: WSAStartup() failed\n", cmdname);
+        return INVALID_SOCKET;
+    }
+#endif
+
+    if (addr[0] == '[') {
+        snprintf(host, sizeof(host), "%s", addr + 1);
+        p = strchr(host, ']');
+        if (!p) {
+            fprintf(stderr, "%s: invalid address %s\n", cmdname, addr);
+            return INVALID_SOCKET;
+        }
+        *p++ = '\0';
+    } else {
+        snprintf(host, sizeof(host), "%s", addr);
+        p = strchr(host, ':');
+    }
+    if (p && *p == ':') {
+        *p++ = '\0';
+        port = addr + (p - host) + (addr[0] == '[');
+    }
+    if (!port) {
+        fprintf(stderr, "%s: need port number in %s\n", cmdname, addr);
+        return INVALID_SOCKET;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    rc = getaddrinfo(host, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "%s: can't resolve %s: %s\n", cmdname, addr,
+          gai_strerror(rc));
+        return INVALID_SOCKET;
+    }
+
+    sock = INVALID_SOCKET;
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    if (sock == INVALID_SOCKET) {
+        fprintf(stderr, "%s: can't connect to %s: %s\n", cmdname, addr,
+          sock_errstr());
+    }
+    return sock;
+}
+
+/*
+ * Waits until socket is readable (or writable), or end_ms passes.
+ * Returns 0 on timeout.
+ */
+static int
+net_wait(sock_t sock, int wr, uint32_t end_ms)
+{
+    struct timeval tv;
+    fd_set fds;
+    int32_t left;
+
+    left = end_ms - time_get_ms();
+    if (left < 0) {
+        return 0;
+    }
+    tv.tv_sec = left / 1000;
+    tv.tv_usec = (left % 1000) * 1000;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    return select(sock + 1, wr ? NULL : &fds, wr ? &fds : NULL, NULL, &tv);
+}
+
+static int
+udp_xport_open(const char *addr)
+{
+    udp.sock = net_connect(addr, UDP_DEFAULT_PORT, SOCK_DGRAM);
+    if (udp.sock == INVALID_SOCKET) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+udp_xport_tx(struct pkt_iov *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+#ifndef WIN32
+    struct iovec siov[SEGX_IOV_CNT];
+    struct msghdr msg;
+
+    if (iovcnt > SEGX_IOV_CNT) {
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        siov[i].iov_base = (void *)iov[i].pi_base;
+        siov[i].iov_len = iov[i].pi_len;
+        len += iov[i].pi_len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = siov;
+    msg.msg_iovlen = iovcnt;
+    if (sendmsg(udp.sock, &msg, 0) != len) {
+        fprintf(stderr, "Write failed: %s\n", sock_errstr());
+        return -1;
+    }
+#else
+    uint8_t buf[UDP_PKT_MAX];
+
+    for (i = 0; i < iovcnt; i++) {
+        if (len + iov[i].pi_len > sizeof(buf)) {
+            return -1;
+        }
+        memcpy(buf + len, iov[i].pi_base, iov[i].pi_len);
+        len += iov[i].pi_len;
+    }
+    if (send(udp.sock, (char *)buf, len, 0) != len) {
+        fprintf(stderr, "Write failed: %d\n", WSAGetLastError());
+        return -1;
+    }
+#endif
+    if (state.verbose > 1) {
+        for (i = 0; i < iovcnt; i++) {
+            dump_hex("TX", (void *)iov[i].pi_base, iov[i].pi_len);
+        }
+    }
+    state.stats.tx_bytes += len;
+    state.stats.tx_pkts++;
+    return 0;
+}
+
+static int
+udp_xport_rx(uint8_t **bufp, uint32_t end_ms)
+{
+    int rc;
+
+    while (1) {
+        rc = net_wait(udp.sock, 0, end_ms);
+        if (rc == 0) {
+            fprintf(stderr, "Read timed out\n");
+            return -14;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        rc = recv(udp.sock, (char *)udp.rxbuf, sizeof(udp.rxbuf), 0);
+        if (rc < 0) {
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        if (rc > 0 && state.verbose > 1) {
+            dump_hex("RX", udp.rxbuf, rc);
+        }
+        if (serial_uploader_is_rsp(udp.rxbuf, rc)) {
+            *bufp = udp.rxbuf;
+            return rc;
+        }
+    }
+}
+
+const struct transport udp_transport = {
+    .t_name = "udp",
+    .t_b64 = 0,
+    .t_open = udp_xport_open,
+    .t_tx = udp_xport_tx,
+    .t_rx = udp_xport_rx,
+};
+
+/*
+ * Telnet/RFC 2217 bits.
+ */
+#define TELNET_SE               240
+#define TELNET_SB               250
+#define TELNET_WILL             251
+#define TELNET_WONT             252
+#define TELNET_DO               253
+#define TELNET_DONT             254
+#define TELNET_IAC              255
+
+#define TELNET_OPT_BINARY       0
+#define TELNET_OPT_SGA          3
+#define TELNET_OPT_COM_PORT     44
+
+#define COM_PORT_SET_BAUDRATE   1
+#define COM_PORT_SET_DATASIZE   2
+#define COM_PORT_SET_PARITY     3
+#define COM_PORT_SET_STOPSIZE   4
+#define COM_PORT_SET_CONTROL    5
+#define COM_PORT_CONTROL_NONE   1
+#define COM_PORT_CONTROL_HW     3
+#define COM_PORT_SERVER_BASE    100     /* server replies to commands */
+
+#define TELNET_SB_MAX           16
+
+enum telnet_rx_state {
+    TELNET_RX_DATA,
+    TELNET_RX_IAC,                      /* got IAC */
+    TELNET_RX_OPT,                      /* got IAC WILL/WONT/DO/DONT */
+    TELNET_RX_SB,                       /* within subnegotiation */
+    TELNET_RX_SB_IAC                    /* got IAC within subnegotiation */
+};
+
+static SESSION_LOCAL struct {
+    sock_t sock;
+    int telnet;
+    enum telnet_rx_state rx_state;
+    uint8_t rx_cmd;                     /* WILL/WONT/DO/DONT */
+    uint8_t sb[TELNET_SB_MAX];
+    int sb_len;
+    int com_port;                       /* 1 agreed, -1 refused */
+    uint32_t baud;                      /* as reported by server */
+} tcp;
+
+/*
+ * Gives up when the server takes nothing for TCP_WRITE_TMO.
+ */
+static int
+tcp_write(void *bufv, size_t len)
+{
+    char *buf = bufv;
+    size_t off;
+    int rc;
+
+    for (off = 0; off < len; off += rc) {
+        rc = send(tcp.sock, buf + off, len - off, 0);
+        if (rc < 0) {
+            if (!sock_again()) {
+                fprintf(stderr, "Write failed: %s\n", sock_errstr());
+                return -1;
+            }
+            rc = net_wait(tcp.sock, 1, time_get_ms() + TCP_WRITE_TMO);
+            if (rc == 0) {
+                fprintf(stderr, "Write timed out, %zu bytes left\n",
+                  len - off);
+                return -1;
+            }
+            if (rc < 0) {
+                fprintf(stderr, "Write failed: %s\n", sock_errstr());
+                return -1;
+            }
+            rc = 0;
+        }
+    }
+    return 0;
+}
+
+static int
+tcp_telnet_send(uint8_t cmd, uint8_t opt)
+{
+    uint8_t buf[3] = { TELNET_IAC, cmd, opt };
+
+    return tcp_write(buf, sizeof(buf));
+}
+
+/*
+ * Option from server. We offered binary mode and COM port control, and
+ * asked for binary mode and SGA from the server; answers to those need no
+ * reply. Anything else the server wants is refused.
+ */
+static void
+tcp_telnet_opt(uint8_t cmd, uint8_t opt)
+{
+    switch (cmd) {
+    case TELNET_DO:
+        if (opt == TELNET_OPT_COM_PORT) {
+            tcp.com_port = 1;
+        } else if (opt != TELNET_OPT_BINARY) {
+            tcp_telnet_send(TELNET_WONT, opt);
+        }
+        break;
+    case TELNET_DONT:
+        if (opt == TELNET_OPT_COM_PORT) {
+            tcp.com_port = -1;
+        }
+        break;
+    case TELNET_WILL:
+        if (opt != TELNET_OPT_BINARY && opt != TELNET_OPT_SGA) {
+            tcp_telnet_send(TELNET_DONT, opt);
+        }
+        break;
+    }
+}
+
+/*
+ * Subnegotiation from server. Only the baud rate reply is of interest.
+ */
+static void
+tcp_telnet_sb(void)
+{
+    if (tcp.sb_len == 6 && tcp.sb[0] == TELNET_OPT_COM_PORT &&
+      tcp.sb[1] == COM_PORT_SERVER_BASE + COM_PORT_SET_BAUDRATE) {
+        tcp.baud = (uint32_t)tcp.sb[2] << 24 | tcp.sb[3] << 16 |
+          tcp.sb[4] << 8 | tcp.sb[5];
+    }
+}
+
+/*
+ * Strips telnet commands from received data in place, returns number of
+ * data bytes left.
+ */
+static int
+tcp_telnet_filter(char *buf, int len)
+{
+    uint8_t c;
+    int i;
+    int off = 0;
+
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+        switch (tcp.rx_state) {
+        case TELNET_RX_DATA:
+            if (c == TELNET_IAC) {
+                tcp.rx_state = TELNET_RX_IAC;
+            } else {
+                buf[off++] = c;
+            }
+            break;
+        case TELNET_RX_IAC:
+            if (c == TELNET_IAC) {
+                buf[off++] = c;
+                tcp.rx_state = TELNET_RX_DATA;
+            } else if (c == TELNET_SB) {
+                tcp.sb_len = 0;
+                tcp.rx_state = TELNET_RX_SB;
+            } else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+                tcp.rx_cmd = c;
+                tcp.rx_state = TELNET_RX_OPT;
+            } else {
+                tcp.rx_state = TELNET_RX_DATA;
+            }
+            break;
+        case TELNET_RX_OPT:
+            tcp_telnet_opt(tcp.rx_cmd, c);
+            tcp.rx_state = TELNET_RX_DATA;
+            break;
+        case TELNET_RX_SB:
+            if (c == TELNET_IAC) {
+                tcp.rx_state = TELNET_RX_SB_IAC;
+            } else if (tcp.sb_len < TELNET_SB_MAX) {
+                tcp.sb[tcp.sb_len++] = c;
+            }
+            break;
+        case TELNET_RX_SB_IAC:
+            if (c == TELNET_SE) {
+                tcp_telnet_sb();
+                tcp.rx_state = TELNET_RX_DATA;
+            } else {
+                if (c == TELNET_IAC && tcp.sb_len < TELNET_SB_MAX) {
+                    tcp.sb[tcp.sb_len++] = c;
+                }
+                tcp.rx_state = TELNET_RX_SB;
+            }
+            break;
+        }
+    }
+    return off;
+}
+
+static int
+tcp_read(char *buf, size_t maxlen, uint32_t end_ms)
+{
+    int rc;
+
+    while (1) {
+        rc = net_wait(tcp.sock, 0, end_ms);
+        if (rc == 0) {
+            fprintf(stderr, "Read timed out\n");
+            return -14;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        rc = recv(tcp.sock, buf, maxlen, 0);
+        if (rc == 0) {
+            fprintf(stderr, "%s: connection closed\n", cmdname);
+            return -1;
+        }
+        if (rc < 0) {
+            if (sock_again()) {
+                continue;
+            }
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        if (tcp.telnet) {
+            rc = tcp_telnet_filter(buf, rc);
+        }
+        if (rc > 0) {
+            if (state.verbose > 1) {
+                dump_hex("RX", buf, rc);
+            }
+            return rc;
+        }
+    }
+}
+
+static const struct nlip_io tcp_io = {
+    .ni_write = tcp_write,
+    .ni_read = tcp_read,
+};
+
+/*
+ * Reads and handles telnet commands from server until done() returns
+ * true, or end_ms passes. Data from the device is dropped; nothing has
+ * been asked from it yet.
+ */
+static int
+tcp_telnet_wait(int (*done)(void), uint32_t end_ms)
+{
+    char buf[64];
+    int rc;
+
+    while (!done()) {
+        rc = net_wait(tcp.sock, 0, end_ms);
+        if (rc == 0) {
+            return 0;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        rc = recv(tcp.sock, buf, sizeof(buf), 0);
+        if (rc == 0) {
+            fprintf(stderr, "%s: connection closed\n", cmdname);
+            return -1;
+        }
+        if (rc < 0) {
+            if (sock_again()) {
+                continue;
+            }
+            fprintf(stderr, "Read failed: %s\n", sock_errstr());
+            return -1;
+        }
+        tcp_telnet_filter(buf, rc);
+    }
+    return 0;
+}
+
+static int
+tcp_com_port_answered(void)
+{
+    return tcp.com_port != 0;
+}
+
+static int
+tcp_baud_answered(void)
+{
+    return tcp.baud != 0;
+}
+
+/*
+ * Offers binary mode and COM port control. Once server agrees to COM port
+ * control, sets up 8N1 at the configured speed, with RTS/CTS if asked
+ * for, and checks the speed server reports back.
+ */
+static int
+tcp_rfc2217_setup(void)
+{
+    uint8_t buf[64];
+    int off = 0;
+    uint32_t speed = state.speed;
+    uint32_t end_ms;
+    int rc;
+    int i;
+
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_WILL;
+    buf[off++] = TELNET_OPT_BINARY;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_DO;
+    buf[off++] = TELNET_OPT_BINARY;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_DO;
+    buf[off++] = TELNET_OPT_SGA;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_WILL;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    rc = tcp_write(buf, off);
+    if (rc) {
+        return rc;
+    }
+
+    end_ms = time_get_ms() + RFC2217_TMO;
+    rc = tcp_telnet_wait(tcp_com_port_answered, end_ms);
+    if (rc) {
+        return rc;
+    }
+    if (tcp.com_port <= 0) {
+        fprintf(stderr, "%s: server %s COM port control, port speed not "
+          "set\n", cmdname, tcp.com_port ? "refused" : "did not agree to");
+        return 0;
+    }
+
+    off = 0;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SB;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    buf[off++] = COM_PORT_SET_BAUDRATE;
+    for (i = 24; i >= 0; i -= 8) {
+        buf[off] = speed >> i;
+        if (buf[off++] == TELNET_IAC) {
+            buf[off++] = TELNET_IAC;
+        }
+    }
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SE;
+
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SB;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    buf[off++] = COM_PORT_SET_DATASIZE;
+    buf[off++] = 8;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SE;
+
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SB;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    buf[off++] = COM_PORT_SET_PARITY;
+    buf[off++] = 1;                     /* none */
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SE;
+
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SB;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    buf[off++] = COM_PORT_SET_STOPSIZE;
+    buf[off++] = 1;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SE;
+
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SB;
+    buf[off++] = TELNET_OPT_COM_PORT;
+    buf[off++] = COM_PORT_SET_CONTROL;
+    buf[off++] = state.flowctl ? COM_PORT_CONTROL_HW : COM_PORT_CONTROL_NONE;
+    buf[off++] = TELNET_IAC;
+    buf[off++] = TELNET_SE;
+
+    rc = tcp_write(buf, off);
+    if (rc) {
+        return rc;
+    }
+    end_ms = time_get_ms() + RFC2217_TMO;
+    rc = tcp_telnet_wait(tcp_baud_answered, end_ms);
+    if (rc) {
+        return rc;
+    }
+    if (tcp.baud == 0) {
+        fprintf(stderr, "%s: server did not confirm port speed %u\n",
+          cmdname, speed);
+    } else if (tcp.baud != speed) {
+        fprintf(stderr, "%s: server set port speed %u, not %u\n",
+          cmdname, tcp.baud, speed);
+    } else if (state.verbose) {
+        fprintf(stdout, "Port speed %u\n", speed);
+    }
+    return 0;
+}
+
+static int
+tcp_open(const char *addr, int telnet)
+{
+    int val = 1;
+#ifdef WIN32
+    u_long nbio = 1;
+#endif
+
+    tcp.sock = net_connect(addr, NULL, SOCK_STREAM);
+    if (tcp.sock == INVALID_SOCKET) {
+        return -1;
+    }
+
+    /*
+     * Packets are written out a whole at a time, no point in waiting for
+     * more data.
+     */
+    if (setsockopt(tcp.sock, IPPROTO_TCP, TCP_NODELAY, (void *)&val,
+        sizeof(val))) {
+        fprintf(stderr, "%s: setsockopt(TCP_NODELAY) fail: %s\n", cmdname,
+          sock_errstr());
+    }
+#ifndef WIN32
+    fcntl(tcp.sock, F_SETFL, fcntl(tcp.sock, F_GETFL) | O_NONBLOCK);
+#else
+    ioctlsocket(tcp.sock, FIONBIO, &nbio);
+#endif
+
+    tcp.telnet = telnet;
+    tcp.rx_state = TELNET_RX_DATA;
+    tcp.com_port = 0;
+    tcp.baud = 0;
+    if (telnet && tcp_rfc2217_setup()) {
+        return -1;
+    }
+    nlip_attach(&tcp_io);
+    return 0;
+}
+
+static int
+tcp_xport_open(const char *addr)
+{
+    return tcp_open(addr, 0);
+}
+
+static int
+rfc2217_xport_open(const char *addr)
+{
+    return tcp_open(addr, 1);
+}
+
+const struct transport tcp_transport = {
+    .t_name = "tcp",
+    .t_b64 = 1,
+    .t_open = tcp_xport_open,
+    .t_tune = nlip_xport_tune,
+    .t_tx = nlip_xport_tx,
+    .t_rx = nlip_xport_rx,
+};
+
+const struct transport rfc2217_transport = {
+    .t_name = "rfc2217",
+    .t_b64 = 1,
+    .t_open = rfc2217_xport_open,
+    .t_tune = nlip_xport_tune,
+    .t_tx = nlip_xport_tx,
+    .t_rx = nlip_xport_rx,
+};
@@ -0,0 +1,627 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#else
+#include <windows.h>
+#include <winsock.h>
+#endif
+#include <assert.h>
+
+#include "serial_upload.h"
+#include "crc/crc16.h"
+#include "base64/base64.h"
+
+/*
+ * Newtmgr over serial console. Packets are base64 encoded, and split into
+ * lines with NLIP markers.
+ */
+#define SHELL_NLIP_PKT          0x0609
+#define SHELL_NLIP_DATA         0x0414
+
+#define PORT_WRITE_IOV_MAX      (SEGX_IOV_CNT + 2)
+
+/*
+ * Lines of a packet are collected to one buffer, and written with as few
+ * calls as possible.
+ */
+#define NLIP_TX_BUF_SZ          4096
+
+static SESSION_LOCAL const struct nlip_io *nlip_io;
+static nlip_console_fn nlip_console;
+
+struct pkt_cursor {
+    struct pkt_iov *pc_iov;
+    int pc_idx;
+    size_t pc_off;
+};
+
+/*
+ * Returns pointer to next len bytes of the packet. Points to the fragment
+ * itself if the bytes are contiguous, otherwise they're gathered to scratch.
+ */
+static const uint8_t *
+pkt_cursor_get(struct pkt_cursor *pc, size_t len, uint8_t *scratch)
+{
+    struct pkt_iov *pi;
+    const uint8_t *ptr;
+    size_t off = 0;
+    size_t cnt;
+
+    pi = &pc->pc_iov[pc->pc_idx];
+    while (pc->pc_off == pi->pi_len) {
+        pc->pc_idx++;
+        pc->pc_off = 0;
+        pi++;
+    }
+    if (pi->pi_len - pc->pc_off >= len) {
+        ptr = pi->pi_base + pc->pc_off;
+        pc->pc_off += len;
+        return ptr;
+    }
+    while (off < len) {
+        cnt = pi->pi_len - pc->pc_off;
+        if (cnt > len - off) {
+            cnt = len - off;
+        }
+        memcpy(scratch + off, pi->pi_base + pc->pc_off, cnt);
+        off += cnt;
+        pc->pc_off += cnt;
+        if (pc->pc_off == pi->pi_len) {
+            pc->pc_idx++;
+            pc->pc_off = 0;
+            pi++;
+        }
+    }
+    return scratch;
+}
+
+static int
+nlip_tx_flush(char *buf, size_t len)
+{
+    if (nlip_io->ni_write(buf, len) < 0) {
+        return -1;
+    }
+    state.stats.tx_bytes += len;
+    return 0;
+}
+
+static int
+port_writev(struct pkt_iov *iov, int iovcnt)
+{
+    struct pkt_iov piov[PORT_WRITE_IOV_MAX];
+    struct pkt_cursor pc;
+    uint16_t crc;
+    uint16_t pkt_len;
+    size_t off;
+    size_t len;
+    size_t boff;
+    size_t blen;
+    size_t toff;
+    const uint8_t *raw;
+    uint8_t scratch[NLIP_LINE_RAW(NLIP_LINE_MAX)];
+    char txbuf[NLIP_TX_BUF_SZ];
+    char *line;
+    int i;
+
+    assert(iovcnt + 2 <= PORT_WRITE_IOV_MAX);
+
+    /*
+     * Packet on the wire is <len><nmgr_hdr+CBOR><crc>.
+     */
+    len = 0;
+    crc = CRC16_INITIAL_CRC;
+    for (i = 0; i < iovcnt; i++) {
+        crc = crc16_ccitt(crc, iov[i].pi_base, iov[i].pi_len);
+        len += iov[i].pi_len;
+        piov[i + 1] = iov[i];
+    }
+    crc = htons(crc);
+    len += sizeof(crc);
+    pkt_len = htons(len);
+    len += sizeof(pkt_len);
+
+    piov[0].pi_base = (uint8_t *)&pkt_len;
+    piov[0].pi_len = sizeof(pkt_len);
+    piov[iovcnt + 1].pi_base = (uint8_t *)&crc;
+    piov[iovcnt + 1].pi_len = sizeof(crc);
+    iovcnt += 2;
+
+    if (state.verbose > 1) {
+        for (i = 0; i < iovcnt; i++) {
+            dump_hex("TX unencoded", (void *)piov[i].pi_base, piov[i].pi_len);
+        }
+    }
+
+    pc.pc_iov = piov;
+    pc.pc_idx = 0;
+    pc.pc_off = 0;
+    toff = 0;
+    for (off = 0; off < len; off += blen) {
+        /* line + NUL from base64_encode() */
+        if (toff + state.linelen + 1 > sizeof(txbuf)) {
+            if (nlip_tx_flush(txbuf, toff) < 0) {
+                return -1;
+            }
+            toff = 0;
+        }
+        line = &txbuf[toff];
+        if (off == 0) {
+            line[0] = SHELL_NLIP_PKT >> 8;
+            line[1] = SHELL_NLIP_PKT & 0xff;
+        } else {
+            line[0] = SHELL_NLIP_DATA >> 8;
+            line[1] = SHELL_NLIP_DATA & 0xff;
+        }
+        boff = 2;
+        blen = state.line_raw;
+        if (blen > len - off) {
+            blen = len - off;
+        }
+        raw = pkt_cursor_get(&pc, blen, scratch);
+        boff += base64_encode(raw, blen, &line[boff], 1);
+        line[boff++] = '\n';
+
+        if (state.verbose > 1) {
+            dump_hex("TX encoded", line, boff);
+        }
+        toff += boff;
+        state.stats.tx_lines++;
+    }
+    if (nlip_tx_flush(txbuf, toff) < 0) {
+        return -1;
+    }
+
+    /*
+     * With flow control device can hold off transmission. Wait until the
+     * packet is out, so that it does not count towards response time.
+     */
+    if (state.flowctl && nlip_io->ni_drain) {
+        if (nlip_io->ni_drain() < 0) {
+            return -1;
+        }
+    }
+    state.stats.tx_pkts++;
+
+    return 0;
+}
+
+static int
+port_write(uint8_t *buf, size_t len)
+{
+    struct pkt_iov iov;
+
+    iov.pi_base = buf;
+    iov.pi_len = len;
+    return port_writev(&iov, 1);
+}
+
+/*
+ * Incoming NLIP data is parsed one byte at a time as it comes in, so
+ * packets can span multiple lines. Bytes past a completed packet stay in
+ * the ring buffer for the next read.
+ */
+#define NLIP_RX_RING_SZ         1024    /* has to be power of 2 */
+#define NLIP_RX_PKT_MAX         2048
+
+enum nlip_rx_state {
+    NLIP_RX_LINE_START,                 /* expecting marker */
+    NLIP_RX_MARKER,                     /* got 1st byte of marker */
+    NLIP_RX_DATA,                       /* base64 data */
+    NLIP_RX_CONSOLE,                    /* not NLIP, console output */
+    NLIP_RX_SKIP                        /* bad NLIP, skip until newline */
+};
+
+struct nlip_rx {
+    char nr_ring[NLIP_RX_RING_SZ];
+    size_t nr_head;                     /* written by port */
+    size_t nr_tail;                     /* consumed by parser */
+    size_t nr_con;                      /* console output not passed on */
+    int nr_con_bol;
+    enum nlip_rx_state nr_state;
+    uint8_t nr_marker;
+    int nr_in_pkt;                      /* packet in progress */
+    uint32_t nr_quad;                   /* base64 bits collected */
+    int nr_quad_cnt;
+    int nr_quad_pad;
+    size_t nr_len;                      /* declared length */
+    size_t nr_off;                      /* decoded bytes, incl. length */
+    uint8_t nr_pkt[NLIP_RX_PKT_MAX];
+};
+
+static SESSION_LOCAL struct nlip_rx nlip_rx;
+
+static SESSION_LOCAL uint8_t nlip_b64_val[256];       /* 0 - not base64, else value + 1 */
+
+static void
+nlip_rx_init(struct nlip_rx *nr)
+{
+    static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    for (i = 0; i < sizeof(b64) - 1; i++) {
+        nlip_b64_val[(uint8_t)b64[i]] = i + 1;
+    }
+    memset(nr, 0, sizeof(*nr));
+}
+
+static void
+nlip_rx_drop(struct nlip_rx *nr, const char *why)
+{
+    if (state.verbose) {
+        fprintf(stderr, "%s: dropping NLIP packet, %s\n", cmdname, why);
+    }
+    nr->nr_in_pkt = 0;
+    nr->nr_state = NLIP_RX_SKIP;
+}
+
+static void
+nlip_rx_byte(struct nlip_rx *nr, uint8_t b)
+{
+    if (nr->nr_off < 2) {
+        nr->nr_len = (nr->nr_len << 8) | b;
+        if (++nr->nr_off == 2 &&
+          (nr->nr_len <= sizeof(uint16_t) || nr->nr_len > NLIP_RX_PKT_MAX)) {
+            nlip_rx_drop(nr, "bad length");
+        }
+        return;
+    }
+    if (nr->nr_off - 2 < nr->nr_len) {
+        nr->nr_pkt[nr->nr_off - 2] = b;
+    }
+    nr->nr_off++;
+}
+
+static void
+nlip_rx_char(struct nlip_rx *nr, char c)
+{
+    uint8_t v;
+
+    if (c == '=') {
+        nr->nr_quad_pad++;
+        v = 0;
+    } else {
+        v = nlip_b64_val[(uint8_t)c];
+        if (!v) {
+            if (c != '\r') {
+                nlip_rx_drop(nr, "invalid character");
+            }
+            return;
+        }
+        v--;
+    }
+    nr->nr_quad = (nr->nr_quad << 6) | v;
+    if (++nr->nr_quad_cnt < 4) {
+        return;
+    }
+    nlip_rx_byte(nr, nr->nr_quad >> 16);
+    if (nr->nr_quad_pad < 2 && nr->nr_in_pkt) {
+        nlip_rx_byte(nr, nr->nr_quad >> 8);
+    }
+    if (nr->nr_quad_pad < 1 && nr->nr_in_pkt) {
+        nlip_rx_byte(nr, nr->nr_quad);
+    }
+    nr->nr_quad = 0;
+    nr->nr_quad_cnt = 0;
+    nr->nr_quad_pad = 0;
+}
+
+/*
+ * Passes console output up to ring index end to the console sink, straight
+ * from the ring.
+ */
+static void
+nlip_rx_console(struct nlip_rx *nr, size_t end)
+{
+    size_t off;
+    size_t cnt;
+
+    while (nr->nr_con != end) {
+        off = nr->nr_con & (NLIP_RX_RING_SZ - 1);
+        cnt = NLIP_RX_RING_SZ - off;
+        if (cnt > end - nr->nr_con) {
+            cnt = end - nr->nr_con;
+        }
+        if (nlip_console) {
+            nlip_console(&nr->nr_ring[off], cnt, nr->nr_con_bol);
+        }
+        nr->nr_con_bol = 0;
+        nr->nr_con += cnt;
+    }
+}
+
+/*
+ * Consumes data from the ring until a packet is complete. Returns packet
+ * length, or 0 if more data is needed. Console output is passed on as it
+ * goes by.
+ */
+static int
+nlip_rx_process(struct nlip_rx *nr)
+{
+    char c;
+
+    while (nr->nr_tail != nr->nr_head) {
+        c = nr->nr_ring[nr->nr_tail++ & (NLIP_RX_RING_SZ - 1)];
+        switch (nr->nr_state) {
+        case NLIP_RX_LINE_START:
+            if (c == (SHELL_NLIP_PKT >> 8) || c == (SHELL_NLIP_DATA >> 8)) {
+                nr->nr_marker = c;
+                nr->nr_state = NLIP_RX_MARKER;
+            } else if (c != '\n' && c != '\r') {
+                nr->nr_state = NLIP_RX_CONSOLE;
+                nr->nr_con = nr->nr_tail - 1;
+                nr->nr_con_bol = 1;
+            }
+            break;
+        case NLIP_RX_MARKER:
+            if (((nr->nr_marker << 8) | (uint8_t)c) == SHELL_NLIP_PKT) {
+                nr->nr_in_pkt = 1;
+                nr->nr_len = 0;
+                nr->nr_off = 0;
+                nr->nr_quad = 0;
+                nr->nr_quad_cnt = 0;
+                nr->nr_quad_pad = 0;
+                nr->nr_state = NLIP_RX_DATA;
+            } else if (((nr->nr_marker << 8) | (uint8_t)c) ==
+              SHELL_NLIP_DATA && nr->nr_in_pkt) {
+                nr->nr_state = NLIP_RX_DATA;
+            } else {
+                /* marker byte may be gone from the ring already */
+                if (nlip_console) {
+                    nlip_console((char *)&nr->nr_marker, 1, 1);
+                }
+                nr->nr_con = nr->nr_tail - 1;
+                nr->nr_con_bol = 0;
+                if (c == '\n') {
+                    nlip_rx_console(nr, nr->nr_tail);
+                    nr->nr_state = NLIP_RX_LINE_START;
+                } else {
+                    nr->nr_state = NLIP_RX_CONSOLE;
+                }
+            }
+            break;
+        case NLIP_RX_DATA:
+            if (c != '\n') {
+                nlip_rx_char(nr, c);
+                break;
+            }
+            nr->nr_state = NLIP_RX_LINE_START;
+            if (nr->nr_off < 2 || nr->nr_off - 2 < nr->nr_len) {
+                break;
+            }
+            nr->nr_in_pkt = 0;
+            if (crc16_ccitt(CRC16_INITIAL_CRC, nr->nr_pkt, nr->nr_len)) {
+                nlip_rx_drop(nr, "CRC mismatch");
+                nr->nr_state = NLIP_RX_LINE_START;
+                break;
+            }
+            if (state.verbose > 1) {
+                dump_hex("RX decoded", nr->nr_pkt, nr->nr_len);
+            }
+            return nr->nr_len - sizeof(uint16_t);
+        case NLIP_RX_CONSOLE:
+            if (c == '\n') {
+                nlip_rx_console(nr, nr->nr_tail);
+                nr->nr_state = NLIP_RX_LINE_START;
+            }
+            break;
+        case NLIP_RX_SKIP:
+            if (c == '\n') {
+                nr->nr_state = NLIP_RX_LINE_START;
+            }
+            break;
+        }
+    }
+    if (nr->nr_state == NLIP_RX_CONSOLE) {
+        /* rest of the line comes with the next read */
+        nlip_rx_console(nr, nr->nr_tail);
+    }
+    return 0;
+}
+
+/*
+ * Waits for a newtmgr response. Returned packet is in the receive
+ * buffer, and stays valid until the next call.
+ */
+static int
+port_read(uint8_t **bufp, uint32_t end_ms)
+{
+    struct nlip_rx *nr = &nlip_rx;
+    size_t off;
+    size_t cnt;
+    int rc;
+
+    while (1) {
+        while ((rc = nlip_rx_process(nr)) > 0) {
+            if (serial_uploader_is_rsp(nr->nr_pkt, rc)) {
+                *bufp = nr->nr_pkt;
+                return rc;
+            }
+        }
+        off = nr->nr_head & (NLIP_RX_RING_SZ - 1);
+        cnt = NLIP_RX_RING_SZ - off;
+        rc = nlip_io->ni_read(&nr->nr_ring[off], cnt, end_ms);
+        if (rc < 0) {
+            return rc;
+        }
+        nr->nr_head += rc;
+    }
+}
+
+
+static void
+flush_dev_console(void)
+{
+    nlip_io->ni_write("\n", 1);
+}
+
+/*
+ * Checks that the device takes lines longer than SHELL_NLIP_MAX_FRAME by
+ * sending an echo request which fills up the first line. Falls back to
+ * default line length if there is no response.
+ */
+int
+nlip_xport_tune(void)
+{
+    uint8_t buf[NLIP_LINE_MAX];
+    char payload[NLIP_LINE_MAX];
+    uint8_t *rsp;
+    size_t cnt;
+    int plen;
+    int rc;
+
+    if (state.linelen <= SHELL_NLIP_MAX_FRAME) {
+        return 0;
+    }
+
+    /*
+     * Packet on the wire has 2 byte length and CRC, and string header
+     * grows by 2 bytes with the payload.
+     */
+    cnt = serial_uploader_echo(buf, sizeof(buf), "", 0);
+    plen = state.line_raw - 2 * sizeof(uint16_t) - cnt - 2;
+    memset(payload, 'x', plen);
+    cnt = serial_uploader_echo(buf, sizeof(buf), payload, plen);
+    if (cnt < 0) {
+        fprintf(stderr, "%s: message encoding issue %zu\n", cmdname, cnt);
+        return (int)cnt;
+    }
+    rc = port_write(buf, cnt);
+    if (rc < 0) {
+        fprintf(stderr, "write fail %d\n", rc);
+        return rc;
+    }
+    rc = port_read(&rsp, time_get_ms() + 2000);
+    if (rc == -14) {
+        fprintf(stderr, "%s: no response with %d byte lines, using %d\n",
+          cmdname, state.linelen, SHELL_NLIP_MAX_FRAME);
+        state.linelen = SHELL_NLIP_MAX_FRAME;
+        state.line_raw = NLIP_LINE_RAW(state.linelen);
+        return 0;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "read fail %d\n", rc);
+        return rc;
+    }
+    if (state.verbose) {
+        fprintf(stdout, "Using %d byte lines\n", state.linelen);
+    }
+    return 0;
+}
+
+/*
+ * Sets where device console output goes; it is discarded by default.
+ */
+void
+nlip_console_attach(nlip_console_fn fn)
+{
+    nlip_console = fn;
+}
+
+/*
+ * Starts NLIP framing on top of a byte stream.
+ */
+void
+nlip_attach(const struct nlip_io *io)
+{
+    nlip_io = io;
+    nlip_rx_init(&nlip_rx);
+    flush_dev_console();
+}
+
+static int
+tty_write(void *buf, size_t len)
+{
+    return port_write_data(state.port, buf, len);
+}
+
+static int
+tty_read(char *buf, size_t maxlen, uint32_t end_ms)
+{
+    return port_read_poll(state.port, buf, maxlen, end_ms, state.verbose);
+}
+
+static int
+tty_drain(void)
+{
+    return port_drain(state.port);
+}
+
+static const struct nlip_io tty_io = {
+    .ni_write = tty_write,
+    .ni_read = tty_read,
+    .ni_drain = tty_drain,
+};
+
+static int
+nlip_xport_open(const char *name)
+{
+    HANDLE fd;
+    int rc;
+
+    fd = port_open(name);
+    if (fd < 0) {
+        return -1;
+    }
+    state.port = fd;
+
+    rc = port_setup(state.port, state.speed, state.flowctl);
+    if (rc < 0) {
+        port_close(state.port);
+        return rc;
+    }
+
+    nlip_attach(&tty_io);
+    return 0;
+}
+
+static void
+nlip_xport_close(void)
+{
+    port_close(state.port);
+}
+
+int
+nlip_xport_tx(struct pkt_iov *iov, int iovcnt)
+{
+    return port_writev(iov, iovcnt);
+}
+
+int
+nlip_xport_rx(uint8_t **bufp, uint32_t end_ms)
+{
+    return port_read(bufp, end_ms);
+}
+
+const struct transport serial_transport = {
+    .t_name = "serial",
+    .t_b64 = 1,
+    .t_open = nlip_xport_open,
+    .t_tune = nlip_xport_tune,
+    .t_tx = nlip_xport_tx,
+    .t_rx = nlip_xport_rx,
+    .t_close = nlip_xport_close,
+};
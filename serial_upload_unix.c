@@ -22,8 +22,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
@@ -31,35 +35,295 @@
 
 #if __linux__
 #include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
-static char *devname;
+/*
+ * Settings for USB-serial adapters, by kernel driver. Latency timer is
+ * how long FTDI-style chips hold on to received data before sending it
+ * over USB; the others flush on their own, and only take the low latency
+ * flag.
+ */
+struct port_profile {
+    const char *pp_driver;
+    const char *pp_name;
+    int pp_latency_timer;               /* ms, -1 if none */
+    int pp_low_latency;
+};
+
+static const struct port_profile port_profiles[] = {
+    { "ftdi_sio", "FTDI", 1, 1 },
+    { "cp210x", "Silicon Labs CP210x", -1, 1 },
+    { "ch341", "WCH CH34x", -1, 1 },
+    { "ch341-uart", "WCH CH34x", -1, 1 },
+    { "pl2303", "Prolific PL2303", -1, 1 },
+    { "cdc_acm", "CDC ACM", -1, 1 },
+    { NULL, "unknown", -1, 1 }
+};
+
+/*
+ * What was changed, so that it can be put back when port is closed, at
+ * exit, or when killed. Kept ready to write as is, as restoring from a
+ * signal handler can't format. One per port open; threaded sessions have
+ * several at once.
+ */
+#define PORT_SAVED_MAX          64
+
+struct port_saved {
+    int ps_used;
+    int ps_fd;
+    char ps_latency_path[PATH_MAX];
+    char ps_latency_val[16];
+    int ps_latency_len;                 /* 0 if not changed */
+    int ps_flags_saved;                 /* serial_flags is valid */
+    int ps_serial_flags;
+};
+
+static struct port_saved port_saved[PORT_SAVED_MAX];
+static SESSION_LOCAL struct port_saved *port_saved_own;
+static int port_saved_hooked;
+
+static SESSION_LOCAL char port_name[PATH_MAX];
+
+static int
+port_sysfs_read(const char *path, char *buf, size_t len)
+{
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = read(fd, buf, len - 1);
+    close(fd);
+    if (rc < 0) {
+        return -1;
+    }
+    while (rc > 0 && (buf[rc - 1] == '\n' || buf[rc - 1] == ' ')) {
+        rc--;
+    }
+    buf[rc] = '\0';
+    return rc;
+}
+
+static int
+port_sysfs_write(const char *path, int val)
+{
+    char buf[16];
+    int fd;
+    int rc;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    snprintf(buf, sizeof(buf), "%d", val);
+    rc = write(fd, buf, strlen(buf));
+    close(fd);
+    return rc < 0 ? -1 : 0;
+}
 
+/*
+ * Finds USB vendor and product id by walking up from the tty device.
+ */
 static void
-port_open_storename(const char *name)
+port_usb_id(const char *devdir, char *id, size_t len)
 {
-    devname = strdup(name);
-    if (!devname) {
+    char path[PATH_MAX];
+    char vid[8];
+    char pid[8];
+    char *p;
+
+    snprintf(id, len, "?");
+    if (!realpath(devdir, path)) {
         return;
     }
-    devname = basename(devname);
+    while ((p = strrchr(path, '/')) && p != path) {
+        strcat(path, "/idVendor");
+        if (port_sysfs_read(path, vid, sizeof(vid)) > 0) {
+            strcpy(strrchr(path, '/'), "/idProduct");
+            port_sysfs_read(path, pid, sizeof(pid));
+            snprintf(id, len, "%s:%s", vid, pid);
+            return;
+        }
+        *p = '\0';
+    }
 }
 
+/*
+ * Called from signal handler too; async-signal-safe calls only.
+ */
 static void
-port_setup_lowlatency(char *string)
+port_restore_one(struct port_saved *ps)
 {
+    struct serial_struct ss;
     int fd;
-    char filename[128];
 
-    snprintf(filename, sizeof(filename) - 1,
-             "/sys/bus/usb-serial/devices/%s/latency_timer", devname);
-    fd = open(filename, O_WRONLY);
-    if (fd < 0) {
-        fprintf(stderr, "Warning: failed to set %s to %s: %s\n",
-                filename, string, strerror(errno));
+    if (ps->ps_latency_len) {
+        fd = open(ps->ps_latency_path, O_WRONLY);
+        if (fd >= 0) {
+            write(fd, ps->ps_latency_val, ps->ps_latency_len);
+            close(fd);
+        }
+    }
+    if (ps->ps_flags_saved && ioctl(ps->ps_fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags = ps->ps_serial_flags;
+        ioctl(ps->ps_fd, TIOCSSERIAL, &ss);
+    }
+}
+
+static void
+port_restore(void)
+{
+    int i;
+
+    for (i = 0; i < PORT_SAVED_MAX; i++) {
+        if (__atomic_load_n(&port_saved[i].ps_used, __ATOMIC_ACQUIRE)) {
+            port_restore_one(&port_saved[i]);
+        }
+    }
+}
+
+static struct port_saved *
+port_saved_claim(int fd)
+{
+    struct port_saved *ps;
+    int i;
+
+    for (i = 0; i < PORT_SAVED_MAX; i++) {
+        ps = &port_saved[i];
+        if (!__atomic_exchange_n(&ps->ps_used, 1, __ATOMIC_ACQ_REL)) {
+            ps->ps_fd = fd;
+            return ps;
+        }
+    }
+    return NULL;
+}
+
+static void
+port_saved_release(struct port_saved *ps)
+{
+    ps->ps_latency_len = 0;
+    ps->ps_flags_saved = 0;
+    __atomic_store_n(&ps->ps_used, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * ^C is the usual way to stop an upload which does not progress; adapter
+ * settings are put back then too. Threaded sessions leave the first ^C
+ * to the watch loop.
+ */
+void
+port_restore_sig(int sig)
+{
+    port_restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Identifies the adapter from sysfs, and applies the settings for it.
+ * Original settings are restored when port is closed, at exit, or when
+ * killed by a signal.
+ */
+static void
+port_setup_profile(int fd, const char *name, int verbose)
+{
+    const struct port_profile *pp;
+    struct port_saved *ps;
+    struct serial_struct ss;
+    char realname[PATH_MAX];
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    char val[16];
+    char usbid[16];
+    char *dev;
+    char *driver = NULL;
+    int old_timer = -1;
+    int rc;
+
+    if (!realpath(name, realname)) {
         return;
     }
-    write(fd, string, strlen(string));
-    close(fd);
+    dev = basename(realname);
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/driver", dev);
+    rc = readlink(path, link, sizeof(link) - 1);
+    if (rc < 0) {
+        /* not a USB or hardware serial port, e.g. pty */
+        return;
+    }
+    link[rc] = '\0';
+    driver = basename(link);
+
+    for (pp = port_profiles; pp->pp_driver; pp++) {
+        if (!strcmp(pp->pp_driver, driver)) {
+            break;
+        }
+    }
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device", dev);
+    port_usb_id(path, usbid, sizeof(usbid));
+
+    ps = port_saved_claim(fd);
+    if (!ps) {
+        fprintf(stderr, "Warning: more than %d ports, %s left as is\n",
+          PORT_SAVED_MAX, dev);
+        return;
+    }
+    port_saved_own = ps;
+    if (!__atomic_exchange_n(&port_saved_hooked, 1, __ATOMIC_ACQ_REL)) {
+        atexit(port_restore);
+        if (!state.threaded) {
+            signal(SIGINT, port_restore_sig);
+            signal(SIGTERM, port_restore_sig);
+            signal(SIGHUP, port_restore_sig);
+        }
+    }
+
+    if (pp->pp_latency_timer >= 0) {
+        snprintf(path, sizeof(path),
+          "/sys/bus/usb-serial/devices/%s/latency_timer", dev);
+        if (port_sysfs_read(path, val, sizeof(val)) > 0) {
+            old_timer = atoi(val);
+        }
+        if (old_timer != pp->pp_latency_timer) {
+            if (port_sysfs_write(path, pp->pp_latency_timer) < 0) {
+                fprintf(stderr, "Warning: failed to set %s to %d: %s\n",
+                        path, pp->pp_latency_timer, strerror(errno));
+            } else if (old_timer >= 0) {
+                snprintf(ps->ps_latency_path, sizeof(ps->ps_latency_path),
+                  "%s", path);
+                snprintf(ps->ps_latency_val, sizeof(ps->ps_latency_val),
+                  "%d", old_timer);
+                ps->ps_latency_len = strlen(ps->ps_latency_val);
+            }
+        }
+    }
+    if (pp->pp_low_latency && ioctl(fd, TIOCGSERIAL, &ss) == 0 &&
+      !(ss.flags & ASYNC_LOW_LATENCY)) {
+        ps->ps_serial_flags = ss.flags;
+        ps->ps_flags_saved = 1;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &ss) < 0) {
+            ps->ps_flags_saved = 0;
+        }
+    }
+
+    fprintf(stdout, "Port %s: %s adapter (%s %s)", dev, pp->pp_name,
+      driver, usbid);
+    if (pp->pp_latency_timer >= 0) {
+        fprintf(stdout, ", latency timer %d ms", pp->pp_latency_timer);
+        if (old_timer >= 0 && old_timer != pp->pp_latency_timer) {
+            fprintf(stdout, " (was %d)", old_timer);
+        }
+    }
+    if (verbose && pp->pp_low_latency) {
+        fprintf(stdout, ", low latency %s",
+          ps->ps_flags_saved ? "set" : "unchanged");
+    }
+    fprintf(stdout, "\n");
 }
 #endif
 
@@ -73,13 +337,13 @@ port_open(const char *name)
         fprintf(stderr, "%s: port %s open failed\n", cmdname, name);
     }
 #if __linux__
-    port_open_storename(name);
+    snprintf(port_name, sizeof(port_name), "%s", name);
 #endif
     return fd;
 }
 
 int
-port_setup(int fd, unsigned long speed)
+port_setup(int fd, unsigned long speed, int flowctl)
 {
     struct termios tios;
     int rc;
@@ -107,10 +371,19 @@ port_setup(int fd, unsigned long speed)
     tios.c_oflag |= ONOCR | ONLRET;
     tios.c_cflag &= ~(CSIZE | CSTOPB | CRTSCTS);
     tios.c_cflag |= CS8 | CREAD | CLOCAL;
+    if (flowctl) {
+        tios.c_cflag |= CRTSCTS;
+    }
     tios.c_lflag &= ~(ISIG | ICANON | ECHO | ECHOE | ECHOK |
       ECHONL | ECHOCTL | ECHOPRT | ECHOKE | FLUSHO | NOFLSH |
       TOSTOP | PENDIN | IEXTEN);
 
+    /*
+     * Reads return whatever is there; port_read_poll() keeps the deadline.
+     */
+    tios.c_cc[VMIN] = 0;
+    tios.c_cc[VTIME] = 0;
+
     switch (speed) {
 #ifdef B115200
     case 115200:
@@ -149,33 +422,207 @@ port_setup(int fd, unsigned long speed)
         return rc;
     }
 #if __linux__
-    port_setup_lowlatency("1");
+    if (port_name[0]) {
+        port_setup_profile(fd, port_name, state.verbose);
+    }
 #endif
+    if (state.uring && uring_port_init(fd) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Output queue. Data which tty does not take right away stays here, and
+ * gets written as the port becomes writable; also while port_read_poll()
+ * waits for input. Head counts bytes queued, tail bytes handed to tty.
+ */
+#define PORT_TXQ_SZ             16384   /* has to be power of 2 */
+#define PORT_WRITE_TMO          5000    /* ms without progress */
+
+static SESSION_LOCAL struct {
+    char buf[PORT_TXQ_SZ];
+    size_t head;
+    size_t tail;
+} port_txq;
+
+static int
+port_poll(int fd, short events, int tmo_ms)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    rc = poll(&pfd, 1, tmo_ms);
+    if (rc < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "%s: poll() fail: %s\n", cmdname, strerror(errno));
+        return -1;
+    }
+    return pfd.revents;
+}
+
+/*
+ * Writes as much of the queue as tty takes without blocking.
+ */
+static int
+port_txq_write(int fd)
+{
+    size_t off;
+    size_t cnt;
+    ssize_t rc;
+
+    while (port_txq.head != port_txq.tail) {
+        off = port_txq.tail & (PORT_TXQ_SZ - 1);
+        cnt = port_txq.head - port_txq.tail;
+        if (cnt > PORT_TXQ_SZ - off) {
+            cnt = PORT_TXQ_SZ - off;
+        }
+        rc = write(fd, &port_txq.buf[off], cnt);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        port_txq.tail += rc;
+        if (rc < cnt) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Waits for tty to take some of the queued data.
+ */
+static int
+port_txq_wait(int fd)
+{
+    size_t tail = port_txq.tail;
+    int rc;
+
+    state.stats.tx_stalls++;
+    rc = port_poll(fd, POLLOUT, PORT_WRITE_TMO);
+    if (rc < 0) {
+        return rc;
+    }
+    if (port_txq_write(fd) < 0) {
+        return -1;
+    }
+    if (port_txq.tail == tail) {
+        fprintf(stderr, "Write timed out, %zu bytes queued\n",
+          port_txq.head - port_txq.tail);
+        return -1;
+    }
     return 0;
 }
 
 int
 port_write_data(int fd, void *buf, size_t len)
 {
-    if (write(fd, buf, len) != len) {
-        fprintf(stderr, "Write failed: %s\n", strerror(errno));
+    char *data = buf;
+    size_t off;
+    size_t cnt;
+
+    if (state.uring) {
+        return uring_port_write(buf, len);
+    }
+    while (len) {
+        cnt = PORT_TXQ_SZ - (port_txq.head - port_txq.tail);
+        if (cnt == 0) {
+            if (port_txq_wait(fd) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        off = port_txq.head & (PORT_TXQ_SZ - 1);
+        if (cnt > PORT_TXQ_SZ - off) {
+            cnt = PORT_TXQ_SZ - off;
+        }
+        if (cnt > len) {
+            cnt = len;
+        }
+        memcpy(&port_txq.buf[off], data, cnt);
+        port_txq.head += cnt;
+        data += cnt;
+        len -= cnt;
+    }
+    return port_txq_write(fd);
+}
+
+int
+port_drain(int fd)
+{
+    if (state.uring) {
+        if (uring_port_drain() < 0) {
+            return -1;
+        }
+    }
+    if (port_txq_write(fd) < 0) {
+        return -1;
+    }
+    while (port_txq.head != port_txq.tail) {
+        if (port_txq_wait(fd) < 0) {
+            return -1;
+        }
+    }
+    if (tcdrain(fd) < 0) {
+        fprintf(stderr, "%s: tcdrain() fail: %s\n", cmdname, strerror(errno));
         return -1;
     }
     return 0;
 }
 
+/*
+ * Puts back adapter settings; needed for threaded sessions, as process
+ * does not exit when a session ends.
+ */
+void
+port_close(int fd)
+{
+#if __linux__
+    if (port_saved_own) {
+        port_restore_one(port_saved_own);
+        port_saved_release(port_saved_own);
+        port_saved_own = NULL;
+    }
+#endif
+    if (state.uring) {
+        uring_port_close();
+    }
+    port_txq.head = port_txq.tail = 0;
+    close(fd);
+}
+
 int
-port_read_poll(int fd, char *buf, size_t maxlen, int end_time, int verbose)
+port_read_poll(int fd, char *buf, size_t maxlen, uint32_t end_ms, int verbose)
 {
-    int now;
+    int32_t tmo;
+    short events;
     int rc = 0;
 
+    if (state.uring) {
+        rc = uring_port_read(buf, maxlen, end_ms);
+        if (rc > 0 && verbose > 1) {
+            dump_hex("RX", buf, rc);
+        }
+        return rc;
+    }
     while (!rc) {
-        now = time_get();
-        if (now > end_time) {
+        tmo = end_ms - time_get_ms();
+        if (tmo < 0) {
             fprintf(stderr, "Read timed out\n");
             return -14;
         }
+        if (port_txq_write(fd) < 0) {
+            return -1;
+        }
         rc = read(fd, buf, maxlen);
         if (rc < 0 && errno == EAGAIN) {
             rc = 0;
@@ -183,6 +630,15 @@ port_read_poll(int fd, char *buf, size_t maxlen, int end_time, int verbose)
         if (rc > 0 && verbose > 1) {
             dump_hex("RX", buf, rc);
         }
+        if (rc == 0) {
+            events = POLLIN;
+            if (port_txq.head != port_txq.tail) {
+                events |= POLLOUT;
+            }
+            if (port_poll(fd, events, tmo + 1) < 0) {
+                return -1;
+            }
+        }
     }
     if (rc < 0) {
         fprintf(stderr, "Read failed: %d %s\n", errno, strerror(errno));
@@ -190,41 +646,83 @@ port_read_poll(int fd, char *buf, size_t maxlen, int end_time, int verbose)
     return rc;
 }
 
+/*
+ * Maps file for reading. Empty file is returned as NULL.
+ */
 int
-file_read(const char *name, size_t *sz, uint8_t **bufp)
+file_map(const char *name, size_t *sz, uint8_t **bufp)
 {
-    FILE *fp;
     struct stat st;
-    uint8_t *buf;
-    int rc;
+    void *buf;
+    int fd;
 
-    fp = fopen(name, "r");
-    if (!fp) {
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "%s: open %s failed: %s\n", cmdname, name,
           strerror(errno));
         return -1;
     }
-
-    rc = stat(name, &st);
-    if (rc < 0) {
+    if (fstat(fd, &st) < 0) {
         fprintf(stderr, "%s: stat %s failed: %s\n", cmdname, name,
           strerror(errno));
+        close(fd);
         return -1;
     }
     *sz = st.st_size;
+    *bufp = NULL;
+    if (st.st_size) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap %s failed: %s\n", cmdname, name,
+              strerror(errno));
+            close(fd);
+            return -1;
+        }
 
-    buf = malloc(st.st_size);
-    if (!buf) {
-        fprintf(stderr, "%s: malloc() failed\n", cmdname);
-        return -1;
+        /*
+         * Read once, front to back; pages behind can go.
+         */
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+        *bufp = buf;
     }
-    rc = fread(buf, st.st_size, 1, fp);
-    if (rc != 1) {
-        fprintf(stderr, "%s: fread %s fail\n", cmdname, name);
+    close(fd);
+    return 0;
+}
+
+void
+file_unmap(uint8_t *buf, size_t sz)
+{
+    if (buf) {
+        munmap(buf, sz);
+    }
+}
+
+int
+dir_list(const char *dir, int (*fn)(const char *name, void *arg), void *arg)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+    char path[1024];
+    int rc = 0;
+
+    dp = opendir(dir);
+    if (!dp) {
+        fprintf(stderr, "%s: open %s failed: %s\n", cmdname, dir,
+          strerror(errno));
         return -1;
     }
-    *bufp = buf;
-    return 0;
+    while (rc == 0 && (de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            rc = fn(de->d_name, arg);
+        }
+    }
+    closedir(dp);
+    return rc;
 }
 
 int
@@ -236,3 +734,23 @@ time_get(void)
 
     return tv.tv_sec;
 }
+
+uint32_t
+time_get_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+void
+time_sleep_ms(uint32_t ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
@@ -0,0 +1,704 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * io_uring engine for serial port I/O, selected with -I uring.
+ *
+ * Writes are copied to a registered buffer and only queued; they get
+ * submitted together with the next read and its timeout. Segment out,
+ * wait for the ack with deadline, is then one io_uring_enter() call
+ * instead of write() + poll() + read().
+ *
+ * With -w sessions are threads of one process, and share one ring. Each
+ * has a slot: its port is the registered file, and its tx and rx buffers
+ * the registered buffers, of that index. Sessions queue entries, and wait
+ * on a condition variable; a ring thread makes the io_uring_enter() calls,
+ * submitting what all sessions have queued, and hands completions to their
+ * sessions. Session which queues while that call is blocked wakes it up
+ * through an eventfd, so its entries go in right away. On a station with
+ * dozens of ports this is one system call per round for all of them.
+ * Requests belong to the thread submitting them, and get cancelled when
+ * it exits; ring thread stays for the life of the process, sessions end
+ * when their port is done.
+ *
+ * Port stays non-blocking. Tty reads do not honour IOCB_NOWAIT, and a
+ * blocking read would be issued inline where the linked timeout cannot
+ * cancel it. So each read and write is preceded by a poll in the same
+ * link chain.
+ *
+ * Uses the raw system calls, so there is no dependency on liburing.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "serial_upload.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#define URING_SESSION_MAX       64      /* ports in one process, -w */
+#define URING_ENTRIES           16      /* per session */
+#define URING_TX_SZ             16384
+#define URING_RX_SZ             4096
+#define URING_WRITE_TMO         5000    /* ms without progress, as poll */
+
+#define URING_BUF_TX            0       /* registered buffer index, */
+#define URING_BUF_RX            1       /* 2 per session slot */
+
+#define URING_UD_WRITE          1       /* sqe user_data, low byte */
+#define URING_UD_READ           2
+#define URING_UD_TIMEOUT        3
+#define URING_UD_POLL           4
+#define URING_UD_KICK           5       /* eventfd read, no session */
+
+struct uring_session {
+    int us_used;
+    int us_slot;
+    uint32_t us_inflight;
+    int us_waiting;                     /* on us_done */
+    pthread_cond_t us_done;
+
+    /*
+     * Queued writes are in tx[tx_off..tx_len).
+     */
+    uint8_t us_tx[URING_TX_SZ];
+    size_t us_tx_off;
+    size_t us_tx_len;
+    int us_tx_err;
+    struct __kernel_timespec us_tx_ts;
+
+    uint8_t us_rx[URING_RX_SZ];
+    int us_rx_res;
+    struct __kernel_timespec us_rx_ts;
+};
+
+static struct {
+    int ring_fd;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t to_submit;
+    int slots;
+
+    pthread_mutex_t lock;               /* all of the above, and sessions */
+    int entering;                       /* ring thread in io_uring_enter() */
+    int failed;                         /* ring thread gave up */
+    int kick_fd;                        /* eventfd, -1 if no ring thread */
+    int kicked;
+    uint64_t kick_val;
+} uring = {
+    .ring_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .kick_fd = -1
+};
+
+static struct uring_session uring_sessions[URING_SESSION_MAX];
+static SESSION_LOCAL struct uring_session *uring_us;
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, uring.ring_fd, to_submit,
+      min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, uring.ring_fd, opcode, arg,
+      nr_args);
+}
+
+/*
+ * Next free entry, for session us or none. Called with lock held.
+ */
+static struct io_uring_sqe *
+uring_sqe_get(struct uring_session *us, int ud)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail;
+    uint32_t idx;
+
+    tail = *uring.sq_tail;
+    idx = tail & *uring.sq_mask;
+    sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[idx] = idx;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+    if (us) {
+        us->us_inflight++;
+        sqe->user_data = (uint64_t)us->us_slot << 8 | ud;
+    } else {
+        sqe->user_data = ud;
+    }
+    return sqe;
+}
+
+static void
+uring_poll_queue(struct uring_session *us, short events)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe_get(us, URING_UD_POLL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = us->us_slot;
+    sqe->poll32_events = events;
+}
+
+/*
+ * Timeout for the entry queued before; it and the rest of its chain get
+ * cancelled when it expires.
+ */
+static void
+uring_timeout_queue(struct uring_session *us, struct __kernel_timespec *ts,
+                    int ms)
+{
+    struct io_uring_sqe *sqe;
+
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000;
+    sqe = uring_sqe_get(us, URING_UD_TIMEOUT);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+}
+
+static void
+uring_write_queue(struct uring_session *us)
+{
+    struct io_uring_sqe *sqe;
+
+    uring_poll_queue(us, POLLOUT);
+    uring_timeout_queue(us, &us->us_tx_ts, URING_WRITE_TMO);
+    sqe = uring_sqe_get(us, URING_UD_WRITE);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = us->us_slot;
+    sqe->addr = (uintptr_t)&us->us_tx[us->us_tx_off];
+    sqe->len = us->us_tx_len - us->us_tx_off;
+    sqe->buf_index = us->us_slot * 2 + URING_BUF_TX;
+}
+
+static void
+uring_kick_queue(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe_get(NULL, URING_UD_KICK);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring.kick_fd;
+    sqe->addr = (uintptr_t)&uring.kick_val;
+    sqe->len = sizeof(uring.kick_val);
+}
+
+/*
+ * Handles one completion, for whichever session it is.
+ */
+static void
+uring_cqe_handle(struct io_uring_cqe *cqe)
+{
+    struct uring_session *us;
+
+    if ((cqe->user_data & 0xff) == URING_UD_KICK) {
+        uring.kicked = 0;
+        uring_kick_queue();
+        return;
+    }
+    us = &uring_sessions[cqe->user_data >> 8];
+    switch (cqe->user_data & 0xff) {
+    case URING_UD_WRITE:
+        if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            uring_write_queue(us);
+            break;
+        }
+        if (cqe->res == -ECANCELED) {
+            /* port not writable within URING_WRITE_TMO */
+            us->us_tx_err = ETIMEDOUT;
+            break;
+        }
+        if (cqe->res < 0) {
+            us->us_tx_err = -cqe->res;
+            break;
+        }
+        us->us_tx_off += cqe->res;
+        if (us->us_tx_off < us->us_tx_len) {
+            /* short write; send the rest */
+            uring_write_queue(us);
+        } else {
+            us->us_tx_off = us->us_tx_len = 0;
+        }
+        break;
+    case URING_UD_READ:
+        us->us_rx_res = cqe->res;
+        break;
+    case URING_UD_TIMEOUT:
+    case URING_UD_POLL:
+    default:
+        break;
+    }
+    us->us_inflight--;
+    if (us->us_inflight == 0 && us->us_waiting) {
+        pthread_cond_signal(&us->us_done);
+    }
+}
+
+/*
+ * Submits what all sessions have queued, waits for at least one
+ * completion, and handles what has completed. Called with lock held,
+ * which is dropped for the system call.
+ */
+static int
+uring_enter_all(void)
+{
+    struct io_uring_cqe *cqe;
+    uint32_t to_submit;
+    uint32_t head;
+    int rc;
+
+    uring.entering = 1;
+    to_submit = uring.to_submit;
+    pthread_mutex_unlock(&uring.lock);
+    rc = uring_enter(to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (rc < 0) {
+        rc = -errno;
+    }
+    pthread_mutex_lock(&uring.lock);
+    uring.entering = 0;
+    if (rc < 0) {
+        if (rc == -EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "%s: io_uring_enter() fail: %s\n", cmdname,
+          strerror(-rc));
+        return -1;
+    }
+    uring.to_submit -= rc;
+    head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        uring_cqe_handle(cqe);
+        head++;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Makes the io_uring_enter() calls for all sessions, when there are
+ * several.
+ */
+static void *
+uring_thread(void *arg)
+{
+    struct uring_session *us;
+    int i;
+
+    pthread_mutex_lock(&uring.lock);
+    while (uring_enter_all() == 0) {
+    }
+    uring.failed = 1;
+    for (i = 0; i < uring.slots; i++) {
+        us = &uring_sessions[i];
+        if (us->us_waiting) {
+            pthread_cond_signal(&us->us_done);
+        }
+    }
+    pthread_mutex_unlock(&uring.lock);
+    return NULL;
+}
+
+/*
+ * Submits entries queued for session, and waits until none of them is in
+ * flight. Called with lock held.
+ */
+static int
+uring_run(struct uring_session *us)
+{
+    int rc = 0;
+
+    if (uring.kick_fd < 0) {
+        /* only session, makes the calls itself */
+        while (us->us_inflight && rc == 0) {
+            rc = uring_enter_all();
+        }
+    } else {
+        if (uring.entering && !uring.kicked) {
+            uring.kicked = 1;
+            eventfd_write(uring.kick_fd, 1);
+        }
+        while (us->us_inflight && !uring.failed) {
+            us->us_waiting = 1;
+            pthread_cond_wait(&us->us_done, &uring.lock);
+            us->us_waiting = 0;
+        }
+        rc = uring.failed ? -1 : 0;
+    }
+    if (rc) {
+        return rc;
+    }
+    if (us->us_tx_err == ETIMEDOUT) {
+        fprintf(stderr, "Write timed out, %zu bytes queued\n",
+          us->us_tx_len - us->us_tx_off);
+    } else if (us->us_tx_err) {
+        fprintf(stderr, "Write failed: %s\n", strerror(us->us_tx_err));
+    }
+    if (us->us_tx_err) {
+        us->us_tx_err = 0;
+        us->us_tx_off = us->us_tx_len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Ring for the process, with room for one session, or as many as watch
+ * mode runs. Called with lock held.
+ */
+static int
+uring_ring_init(void)
+{
+    struct io_uring_params p;
+    struct iovec iov[URING_SESSION_MAX * 2];
+    int fds[URING_SESSION_MAX];
+    sigset_t old_sigs;
+    sigset_t sigs;
+    pthread_t thread;
+    size_t sq_sz;
+    size_t cq_sz;
+    void *sq;
+    void *cq;
+    int rc;
+    int i;
+
+    uring.slots = state.threaded ? URING_SESSION_MAX : 1;
+    memset(&p, 0, sizeof(p));
+    uring.ring_fd = uring_setup(URING_ENTRIES * uring.slots, &p);
+    if (uring.ring_fd < 0) {
+        fprintf(stderr, "%s: io_uring_setup() fail: %s\n", cmdname,
+          strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "%s: io_uring too old\n", cmdname);
+        goto err;
+    }
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_sz > sq_sz) {
+        sq_sz = cq_sz;
+    }
+    sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      uring.ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        goto err_mmap;
+    }
+    cq = sq;
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+      IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        goto err_mmap;
+    }
+    uring.sq_head = sq + p.sq_off.head;
+    uring.sq_tail = sq + p.sq_off.tail;
+    uring.sq_mask = sq + p.sq_off.ring_mask;
+    uring.sq_array = sq + p.sq_off.array;
+    uring.cq_head = cq + p.cq_off.head;
+    uring.cq_tail = cq + p.cq_off.tail;
+    uring.cq_mask = cq + p.cq_off.ring_mask;
+    uring.cqes = cq + p.cq_off.cqes;
+
+    for (i = 0; i < uring.slots; i++) {
+        uring_sessions[i].us_slot = i;
+        pthread_cond_init(&uring_sessions[i].us_done, NULL);
+        iov[i * 2 + URING_BUF_TX].iov_base = uring_sessions[i].us_tx;
+        iov[i * 2 + URING_BUF_TX].iov_len = URING_TX_SZ;
+        iov[i * 2 + URING_BUF_RX].iov_base = uring_sessions[i].us_rx;
+        iov[i * 2 + URING_BUF_RX].iov_len = URING_RX_SZ;
+        fds[i] = -1;
+    }
+    if (uring_register(IORING_REGISTER_BUFFERS, iov, uring.slots * 2) < 0 ||
+      uring_register(IORING_REGISTER_FILES, fds, uring.slots) < 0) {
+        fprintf(stderr, "%s: io_uring_register() fail: %s\n", cmdname,
+          strerror(errno));
+        goto err;
+    }
+    if (uring.slots > 1) {
+        uring.kick_fd = eventfd(0, EFD_CLOEXEC);
+        if (uring.kick_fd < 0) {
+            fprintf(stderr, "%s: eventfd() fail: %s\n", cmdname,
+              strerror(errno));
+            goto err;
+        }
+        uring_kick_queue();
+
+        /* signals are for the main thread */
+        sigfillset(&sigs);
+        pthread_sigmask(SIG_SETMASK, &sigs, &old_sigs);
+        rc = pthread_create(&thread, NULL, uring_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+        if (rc) {
+            fprintf(stderr, "%s: pthread_create() fail: %s\n", cmdname,
+              strerror(rc));
+            close(uring.kick_fd);
+            uring.kick_fd = -1;
+            goto err;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+
+err_mmap:
+    fprintf(stderr, "%s: io_uring mmap() fail: %s\n", cmdname,
+      strerror(errno));
+err:
+    close(uring.ring_fd);
+    uring.ring_fd = -1;
+    return -1;
+}
+
+/*
+ * Takes a slot for the session, and registers its port there.
+ */
+int
+uring_port_init(int fd)
+{
+    struct io_uring_files_update fu;
+    struct uring_session *us = NULL;
+    int rc = -1;
+    int i;
+
+    pthread_mutex_lock(&uring.lock);
+    if (uring.ring_fd < 0 && uring_ring_init() < 0) {
+        goto out;
+    }
+    for (i = 0; i < uring.slots; i++) {
+        if (!uring_sessions[i].us_used) {
+            us = &uring_sessions[i];
+            break;
+        }
+    }
+    if (!us) {
+        fprintf(stderr, "%s: more than %d ports on io_uring\n", cmdname,
+          uring.slots);
+        goto out;
+    }
+    memset(&fu, 0, sizeof(fu));
+    fu.offset = us->us_slot;
+    fu.fds = (uintptr_t)&fd;
+    if (uring_register(IORING_REGISTER_FILES_UPDATE, &fu, 1) < 0) {
+        fprintf(stderr, "%s: io_uring_register() fail: %s\n", cmdname,
+          strerror(errno));
+        goto out;
+    }
+    us->us_used = 1;
+    us->us_tx_off = us->us_tx_len = 0;
+    us->us_tx_err = 0;
+    uring_us = us;
+    rc = 0;
+out:
+    pthread_mutex_unlock(&uring.lock);
+    return rc;
+}
+
+void
+uring_port_close(void)
+{
+    struct io_uring_files_update fu;
+    struct uring_session *us = uring_us;
+    int fd = -1;
+
+    if (!us) {
+        return;
+    }
+    pthread_mutex_lock(&uring.lock);
+    memset(&fu, 0, sizeof(fu));
+    fu.offset = us->us_slot;
+    fu.fds = (uintptr_t)&fd;
+    uring_register(IORING_REGISTER_FILES_UPDATE, &fu, 1);
+    us->us_used = 0;
+    pthread_mutex_unlock(&uring.lock);
+    uring_us = NULL;
+}
+
+int
+uring_port_write(const void *buf, size_t len)
+{
+    struct uring_session *us = uring_us;
+    const uint8_t *data = buf;
+    size_t cnt;
+
+    while (len) {
+        if (us->us_tx_len == URING_TX_SZ) {
+            state.stats.tx_stalls++;
+            if (uring_port_drain() < 0) {
+                return -1;
+            }
+        }
+        cnt = URING_TX_SZ - us->us_tx_len;
+        if (cnt > len) {
+            cnt = len;
+        }
+        memcpy(&us->us_tx[us->us_tx_len], data, cnt);
+        us->us_tx_len += cnt;
+        data += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+/*
+ * Writes out everything queued.
+ */
+int
+uring_port_drain(void)
+{
+    struct uring_session *us = uring_us;
+    int rc;
+
+    pthread_mutex_lock(&uring.lock);
+    if (us->us_tx_len > us->us_tx_off) {
+        uring_write_queue(us);
+    }
+    rc = uring_run(us);
+    pthread_mutex_unlock(&uring.lock);
+    return rc;
+}
+
+/*
+ * Submits queued writes, and poll + read for the port, with the poll timing
+ * out at end_ms.
+ */
+int
+uring_port_read(char *buf, size_t maxlen, uint32_t end_ms)
+{
+    struct uring_session *us = uring_us;
+    struct io_uring_sqe *sqe;
+    int32_t tmo;
+    int rc;
+
+    if (maxlen > URING_RX_SZ) {
+        maxlen = URING_RX_SZ;
+    }
+    do {
+        tmo = end_ms - time_get_ms();
+        if (tmo < 0) {
+            fprintf(stderr, "Read timed out\n");
+            return -14;
+        }
+        pthread_mutex_lock(&uring.lock);
+        if (us->us_tx_len > us->us_tx_off) {
+            uring_write_queue(us);
+        }
+        uring_poll_queue(us, POLLIN);
+        uring_timeout_queue(us, &us->us_rx_ts, tmo);
+        sqe = uring_sqe_get(us, URING_UD_READ);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = us->us_slot;
+        sqe->addr = (uintptr_t)us->us_rx;
+        sqe->len = maxlen;
+        sqe->buf_index = us->us_slot * 2 + URING_BUF_RX;
+
+        rc = uring_run(us);
+        pthread_mutex_unlock(&uring.lock);
+        if (rc < 0) {
+            return -1;
+        }
+        if (us->us_rx_res == -ECANCELED || us->us_rx_res == -EINTR ||
+          us->us_rx_res == -EAGAIN) {
+            us->us_rx_res = 0;
+        }
+        if (us->us_rx_res < 0) {
+            fprintf(stderr, "Read failed: %s\n", strerror(-us->us_rx_res));
+            return -1;
+        }
+    } while (us->us_rx_res == 0);
+    memcpy(buf, us->us_rx, us->us_rx_res);
+    return us->us_rx_res;
+}
+
+#else
+
+int
+uring_port_init(int fd)
+{
+    fprintf(stderr, "%s: io_uring not supported in this build\n", cmdname);
+    return -1;
+}
+
+void
+uring_port_close(void)
+{
+}
+
+int
+uring_port_write(const void *buf, size_t len)
+{
+    return -1;
+}
+
+int
+uring_port_drain(void)
+{
+    return -1;
+}
+
+int
+uring_port_read(char *buf, size_t maxlen, uint32_t end_ms)
+{
+    return -1;
+}
+
+#endif
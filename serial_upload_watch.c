@@ -0,0 +1,322 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Watch mode, -w. Serial ports matching a pattern are picked up as they
+ * appear in their directory, and each one is handled in a process of its
+ * own. Ports present when watching starts are handled too.
+ *
+ * With -I uring sessions are threads instead, so that they share one
+ * ring. Each starts with a copy of the options in state. First ^C stops
+ * watching and ends stats sampling, and sessions in progress finish;
+ * second one restores adapter settings and kills the process.
+ */
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "serial_upload.h"
+
+#if __linux__
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+#define WATCH_DEV_MAX           64
+#define WATCH_POLL_MS           250
+
+/*
+ * Device node shows up before udev has set its permissions.
+ */
+#define WATCH_SETTLE_MS         500
+
+/*
+ * Port which appears again right after its session ended is the same
+ * board re-enumerating after reset, not a new one.
+ */
+#define WATCH_HOLDOFF_MS        3000
+
+struct watch_dev {
+    char wd_path[PATH_MAX];
+    int wd_busy;
+    pid_t wd_pid;
+    pthread_t wd_thread;
+    int wd_exited;                      /* thread done, wd_rc valid */
+    int wd_rc;
+    uint32_t wd_start_ms;
+    uint32_t wd_done_ms;
+};
+
+static struct watch_dev watch_devs[WATCH_DEV_MAX];
+static int watch_dev_cnt;
+static int watch_ok;
+static int watch_failed;
+static volatile sig_atomic_t watch_stop;
+static struct upload_state watch_state;
+static int (*watch_session)(const char *devname);
+
+static void
+watch_sig(int sig)
+{
+    watch_stop = 1;
+    if (watch_state.threaded) {
+        stats_interrupt();
+        signal(sig, port_restore_sig);
+    }
+}
+
+static void *
+watch_thread(void *arg)
+{
+    struct watch_dev *wd = arg;
+
+    state = watch_state;
+    usleep(WATCH_SETTLE_MS * 1000);
+    wd->wd_rc = watch_session(wd->wd_path);
+    __atomic_store_n(&wd->wd_exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static struct watch_dev *
+watch_dev_find(const char *path)
+{
+    int i;
+
+    for (i = 0; i < watch_dev_cnt; i++) {
+        if (!strcmp(watch_devs[i].wd_path, path)) {
+            return &watch_devs[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+watch_dev_start(const char *dir, const char *name, int ifd,
+                int (*session)(const char *devname))
+{
+    struct watch_dev *wd;
+    char path[PATH_MAX];
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    wd = watch_dev_find(path);
+    if (wd) {
+        if (wd->wd_busy ||
+          time_get_ms() - wd->wd_done_ms < WATCH_HOLDOFF_MS) {
+            return;
+        }
+    } else {
+        if (watch_dev_cnt >= WATCH_DEV_MAX) {
+            fprintf(stderr, "%s: more than %d ports, ignoring %s\n",
+              cmdname, WATCH_DEV_MAX, path);
+            return;
+        }
+        wd = &watch_devs[watch_dev_cnt++];
+        strcpy(wd->wd_path, path);
+    }
+
+    if (watch_state.threaded) {
+        wd->wd_exited = 0;
+        if (pthread_create(&wd->wd_thread, NULL, watch_thread, wd)) {
+            fprintf(stderr, "%s: pthread_create() failed\n", cmdname);
+            return;
+        }
+        goto started;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: fork() failed: %s\n", cmdname, strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        close(ifd);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        usleep(WATCH_SETTLE_MS * 1000);
+        exit(session(path) ? 1 : 0);
+    }
+    wd->wd_pid = pid;
+started:
+    wd->wd_busy = 1;
+    wd->wd_start_ms = time_get_ms();
+    fprintf(stdout, "%s: started\n", path);
+    fflush(stdout);
+}
+
+static void
+watch_done(struct watch_dev *wd, int ok)
+{
+    uint32_t ms;
+
+    wd->wd_busy = 0;
+    wd->wd_pid = 0;
+    wd->wd_done_ms = time_get_ms();
+    ms = wd->wd_done_ms - wd->wd_start_ms;
+    if (ok) {
+        watch_ok++;
+        fprintf(stdout, "%s: done in %u.%03us\n", wd->wd_path,
+          ms / 1000, ms % 1000);
+    } else {
+        watch_failed++;
+        fprintf(stdout, "%s: FAILED after %u.%03us\n", wd->wd_path,
+          ms / 1000, ms % 1000);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Collects finished sessions, and reports their results.
+ */
+static void
+watch_reap(int block)
+{
+    struct watch_dev *wd;
+    pid_t pid;
+    int status;
+    int i;
+
+    if (watch_state.threaded) {
+        for (i = 0; i < watch_dev_cnt; i++) {
+            wd = &watch_devs[i];
+            if (wd->wd_busy && (block ||
+                __atomic_load_n(&wd->wd_exited, __ATOMIC_ACQUIRE))) {
+                pthread_join(wd->wd_thread, NULL);
+                watch_done(wd, wd->wd_rc == 0);
+            }
+        }
+        return;
+    }
+    while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+        for (i = 0; i < watch_dev_cnt; i++) {
+            wd = &watch_devs[i];
+            if (wd->wd_busy && wd->wd_pid == pid) {
+                break;
+            }
+        }
+        if (i == watch_dev_cnt) {
+            continue;
+        }
+        watch_done(wd, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+}
+
+int
+port_watch(const char *pattern, int (*session)(const char *devname))
+{
+    char dir_buf[PATH_MAX];
+    char base_buf[PATH_MAX];
+    char evbuf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd;
+    struct dirent *de;
+    const char *dir;
+    const char *glob;
+    DIR *dp;
+    ssize_t len;
+    char *p;
+    int ifd;
+
+    if (strlen(pattern) >= sizeof(dir_buf)) {
+        fprintf(stderr, "%s: pattern too long\n", cmdname);
+        return -1;
+    }
+    strcpy(dir_buf, pattern);
+    strcpy(base_buf, pattern);
+    dir = dirname(dir_buf);
+    glob = basename(base_buf);
+
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) {
+        fprintf(stderr, "%s: inotify_init1() failed: %s\n", cmdname,
+          strerror(errno));
+        return -1;
+    }
+    if (inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "%s: watch %s failed: %s\n", cmdname, dir,
+          strerror(errno));
+        close(ifd);
+        return -1;
+    }
+    state.threaded = state.uring;
+    watch_state = state;
+    watch_session = session;
+    signal(SIGINT, watch_sig);
+    signal(SIGTERM, watch_sig);
+    if (state.threaded) {
+        signal(SIGHUP, port_restore_sig);
+    }
+    fprintf(stdout, "Watching for %s/%s, ^C to stop\n", dir, glob);
+
+    dp = opendir(dir);
+    if (dp) {
+        while ((de = readdir(dp)) != NULL) {
+            if (!fnmatch(glob, de->d_name, 0)) {
+                watch_dev_start(dir, de->d_name, ifd, session);
+            }
+        }
+        closedir(dp);
+    }
+
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    while (!watch_stop) {
+        if (poll(&pfd, 1, WATCH_POLL_MS) > 0) {
+            while ((len = read(ifd, evbuf, sizeof(evbuf))) > 0) {
+                for (p = evbuf; p < evbuf + len;
+                     p += sizeof(*ev) + ev->len) {
+                    ev = (struct inotify_event *)p;
+                    if (ev->len && !fnmatch(glob, ev->name, 0)) {
+                        watch_dev_start(dir, ev->name, ifd, session);
+                    }
+                }
+            }
+        }
+        watch_reap(0);
+    }
+    close(ifd);
+
+    watch_reap(1);
+    fprintf(stdout, "%d ok, %d failed\n", watch_ok, watch_failed);
+    return watch_failed ? -1 : 0;
+}
+
+#else
+
+int
+port_watch(const char *pattern, int (*session)(const char *devname))
+{
+    fprintf(stderr, "%s: watching ports not supported on this platform\n",
+      cmdname);
+    return -1;
+}
+
+#endif
@@ -28,6 +28,8 @@
 #define GetTickCount64 GetTickCount
 #endif
 
+#define PORT_QUEUE_SZ   16384
+
 /*
  * https://docs.microsoft.com/en-us/previous-versions/ff802693(v=msdn.10)#overview
  * https://docs.microsoft.com/en-us/windows/desktop/devio/configuring-a-communications-resource
@@ -55,7 +57,7 @@ port_open(const char *name)
 }
 
 int
-port_setup(HANDLE fd, unsigned long speed)
+port_setup(HANDLE fd, unsigned long speed, int flowctl)
 {
     DCB dcb;
     COMMTIMEOUTS timeouts;
@@ -80,6 +82,10 @@ port_setup(HANDLE fd, unsigned long speed)
 
     dcb.fOutxCtsFlow = FALSE;
     dcb.fOutxDsrFlow = FALSE;
+    if (flowctl) {
+        dcb.fOutxCtsFlow = TRUE;
+        dcb.fRtsControl = RTS_CONTROL_HANDSHAKE;
+    }
 
     /*
     dcb.fDtrControl = DTR_CONTROL_ENABLE;
@@ -94,6 +100,14 @@ port_setup(HANDLE fd, unsigned long speed)
         return -1;
     }
 
+    /*
+     * Driver buffers big enough for a full upload segment both ways.
+     */
+    if (!SetupComm(fd, PORT_QUEUE_SZ, PORT_QUEUE_SZ)) {
+        fprintf(stderr, "%s: SetupComm() failed - error %ld\n",
+                cmdname, GetLastError());
+    }
+
     /*
      * Set timeouts such that reads return after 1 ms.
      */
@@ -148,15 +162,39 @@ port_write_data(HANDLE fd, void *bufv, size_t len)
 }
 
 int
-port_read_poll(HANDLE fd, char *buf, size_t maxlen, int end_time, int verbose)
+port_drain(HANDLE fd)
+{
+    if (!FlushFileBuffers(fd)) {
+        fprintf(stderr, "%s: FlushFileBuffers() failed - error %ld\n",
+                cmdname, GetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+void
+port_close(HANDLE fd)
+{
+    CloseHandle(fd);
+}
+
+int
+port_watch(const char *pattern, int (*session)(const char *devname))
+{
+    fprintf(stderr, "%s: watching ports not supported on this platform\n",
+            cmdname);
+    return -1;
+}
+
+int
+port_read_poll(HANDLE fd, char *buf, size_t maxlen, uint32_t end_ms,
+               int verbose)
 {
-    int now;
     int rc = 0;
     DWORD len;
 
     while (!rc) {
-        now = time_get();
-        if (now > end_time) {
+        if ((int32_t)(time_get_ms() - end_ms) > 0) {
             fprintf(stderr, "Read timed out\n");
             return -14;
         }
@@ -176,13 +214,16 @@ port_read_poll(HANDLE fd, char *buf, size_t maxlen, int end_time, int verbose)
     return rc;
 }
 
+/*
+ * Maps file for reading. Empty file is returned as NULL.
+ */
 int
-file_read(const char *name, size_t *sz, uint8_t **bufp)
+file_map(const char *name, size_t *sz, uint8_t **bufp)
 {
     HANDLE fd;
-    int len;
-    DWORD len2;
-    uint8_t *buf = NULL;
+    HANDLE map;
+    DWORD len;
+    void *buf;
 
     fd = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -196,29 +237,69 @@ file_read(const char *name, size_t *sz, uint8_t **bufp)
     if (len == INVALID_FILE_SIZE) {
         fprintf(stderr, "%s: GetFileSize(%s) failed - error %ld\n",
                 cmdname, name, GetLastError());
-        goto err;
+        CloseHandle(fd);
+        return -1;
     }
-
-    buf = malloc(len);
-    if (!buf) {
-        fprintf(stderr, "%s: malloc() failure\n", cmdname);
-        goto err;
+    *sz = len;
+    *bufp = NULL;
+    if (len == 0) {
+        CloseHandle(fd);
+        return 0;
     }
 
-    if (!ReadFile(fd, buf, len, &len2, NULL)) {
-        fprintf(stderr, "%s: file read len %d failed err %d",
-                cmdname, len, GetLastError());
-        goto err;
+    map = CreateFileMappingA(fd, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map == NULL) {
+        fprintf(stderr, "%s: CreateFileMappingA(%s) failed - error %ld\n",
+                cmdname, name, GetLastError());
+        CloseHandle(fd);
+        return -1;
+    }
+    buf = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    if (buf == NULL) {
+        fprintf(stderr, "%s: MapViewOfFile(%s) failed - error %ld\n",
+                cmdname, name, GetLastError());
     }
+    CloseHandle(map);
     CloseHandle(fd);
-
+    if (buf == NULL) {
+        return -1;
+    }
     *bufp = buf;
-    *sz = len;
     return 0;
-err:
-    free(buf);
-    CloseHandle(fd);
-    return -1;
+}
+
+void
+file_unmap(uint8_t *buf, size_t sz)
+{
+    if (buf) {
+        UnmapViewOfFile(buf);
+    }
+}
+
+int
+dir_list(const char *dir, int (*fn)(const char *name, void *arg), void *arg)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE h;
+    char pattern[MAX_PATH];
+    int rc = 0;
+
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+    h = FindFirstFileA(pattern, &fd);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: FindFirstFileA(%s) failed - error %ld\n",
+                cmdname, dir, GetLastError());
+        return -1;
+    }
+    do {
+        if (fd.cFileName[0] == '.' ||
+            (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            continue;
+        }
+        rc = fn(fd.cFileName, arg);
+    } while (rc == 0 && FindNextFileA(h, &fd));
+    FindClose(h);
+    return rc;
 }
 
 int
@@ -226,3 +307,15 @@ time_get(void)
 {
     return (int)(GetTickCount64() / 1000);
 }
+
+uint32_t
+time_get_ms(void)
+{
+    return (uint32_t)GetTickCount64();
+}
+
+void
+time_sleep_ms(uint32_t ms)
+{
+    Sleep(ms);
+}
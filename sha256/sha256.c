@@ -0,0 +1,172 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * SHA-256 as in FIPS 180-4.
+ */
+#include <string.h>
+
+#include "sha256/sha256.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)       (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)     (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)    (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)           (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)           (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)           (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)           (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static void
+sha256_block(uint32_t *st, const uint8_t *p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] << 8) | p[3];
+        p += 4;
+    }
+    for (; i < 64; i++) {
+        w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+    }
+
+    a = st[0];
+    b = st[1];
+    c = st[2];
+    d = st[3];
+    e = st[4];
+    f = st[5];
+    g = st[6];
+    h = st[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + S1(e) + CH(e, f, g) + sha256_k[i] + w[i];
+        t2 = S0(a) + MAJ(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+    st[5] += f;
+    st[6] += g;
+    st[7] += h;
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t off;
+    size_t cnt;
+
+    off = ctx->count % SHA256_BLOCK_LEN;
+    ctx->count += len;
+    if (off) {
+        cnt = SHA256_BLOCK_LEN - off;
+        if (cnt > len) {
+            cnt = len;
+        }
+        memcpy(ctx->buf + off, p, cnt);
+        p += cnt;
+        len -= cnt;
+        if (off + cnt < SHA256_BLOCK_LEN) {
+            return;
+        }
+        sha256_block(ctx->state, ctx->buf);
+    }
+    while (len >= SHA256_BLOCK_LEN) {
+        sha256_block(ctx->state, p);
+        p += SHA256_BLOCK_LEN;
+        len -= SHA256_BLOCK_LEN;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, uint8_t *digest)
+{
+    uint64_t bits;
+    size_t off;
+    int i;
+
+    bits = ctx->count * 8;
+    off = ctx->count % SHA256_BLOCK_LEN;
+    ctx->buf[off++] = 0x80;
+    if (off > SHA256_BLOCK_LEN - 8) {
+        memset(ctx->buf + off, 0, SHA256_BLOCK_LEN - off);
+        sha256_block(ctx->state, ctx->buf);
+        off = 0;
+    }
+    memset(ctx->buf + off, 0, SHA256_BLOCK_LEN - 8 - off);
+    for (i = 0; i < 8; i++) {
+        ctx->buf[SHA256_BLOCK_LEN - 1 - i] = bits >> (i * 8);
+    }
+    sha256_block(ctx->state, ctx->buf);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}